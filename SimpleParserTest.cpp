@@ -3,9 +3,15 @@
 #include <string>
 #include <iostream>
 #include <memory>
+#include <fstream>
+#include <sstream>
 
 #include "parser.h"
 #include "installed_functions.h"
+#include "daemon.h"
+#include "transpiler.h"
+#include "compiled_script.h"
+#include "tests.h"
 
 using namespace std;
 
@@ -38,13 +44,74 @@ string text =
 
 int main(int argc, char* argv[])
 {
+    native_table builtins(builtin_natives);
     activation_record r;
-    r.install_function(f_pause, 1, "pause");
-    r.install_function(f_click, 2, "click");
-    r.install_function(f_dump, 1, "dump");
+    r.install_natives(builtins);
+
+    // SimpleParser2 --serve [workers]: run as a script daemon on stdin/stdout
+    if (argc > 1 && string(argv[1]) == "--serve")
+    {
+        int workers = argc > 2 ? atoi(argv[2]) : thread::hardware_concurrency();
+        script_daemon daemon(r, workers);
+        daemon.serve(cin, cout);
+        return 0;
+    }
+
+    // SimpleParser2 --test [compile command]: run the regression tests, see tests.h
+    if (argc > 1 && string(argv[1]) == "--test")
+        return run_tests(argc > 2 ? argv[2] : "") == 0 ? 0 : 1;
 
     auto& ns = r.get_ns();
 
+    // SimpleParser2 --transpile [script file]: write the script, or the sample, as C++ to stdout
+    if (argc > 1 && string(argv[1]) == "--transpile")
+    {
+        string source = text;
+        if (argc > 2)
+        {
+            ifstream in(argv[2]);
+            stringstream buffer;
+            buffer << in.rdbuf();
+            source = buffer.str();
+        }
+        transpile_target target;
+        target.includes.push_back("\"installed_functions.h\"");
+        target.natives = { { "pause", 1, "f_pause" }, { "click", 2, "f_click" }, { "dump", 1, "f_dump" } };
+        try
+        {
+            unique_ptr<program> script(parser(source).parse(ns));
+            cout << transpile(*script, target);
+        }
+        catch (const parse_exception& ex)
+        {
+            cerr << "parse exception at line " << ex.row << ", char " << ex.col << ": " << ex.text << endl;
+            return 1;
+        }
+        catch (const runtime_exception& ex)
+        {
+            cerr << "cannot transpile: " << ex.text << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    // SimpleParser2 --run-compiled <library>: execute a transpiled and compiled script instead of parsing
+    if (argc > 2 && string(argv[1]) == "--run-compiled")
+    {
+        try
+        {
+            compiled_script script(argv[2]);
+            cout << "executing:" << endl;
+            script.execute(r);
+        }
+        catch (const runtime_exception& ex)
+        {
+            cerr << "runtime exception: " << ex.text << endl;
+            return 1;
+        }
+        return 0;
+    }
+
     parser p(text);
     unique_ptr<program> tree;
     try
@@ -0,0 +1,44 @@
+#include "stdafx.h"
+#include "compiled_script.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+namespace
+{
+    void close_library(void* library)
+    {
+#ifdef _WIN32
+        FreeLibrary(static_cast<HMODULE>(library));
+#else
+        dlclose(library);
+#endif
+    }
+}
+
+compiled_script::compiled_script(const string& library_path, const string& entry_name)
+{
+#ifdef _WIN32
+    auto module = LoadLibraryA(library_path.c_str());
+    library = module;
+    entry = module != nullptr ? reinterpret_cast<entry_function>(GetProcAddress(module, entry_name.c_str())) : nullptr;
+#else
+    library = dlopen(library_path.c_str(), RTLD_NOW);
+    entry = library != nullptr ? reinterpret_cast<entry_function>(dlsym(library, entry_name.c_str())) : nullptr;
+#endif
+    if (library == nullptr)
+        throw runtime_exception("cannot load compiled script " + library_path);
+    if (entry == nullptr)
+    {
+        close_library(library);
+        throw runtime_exception("no entry point " + entry_name + " in compiled script " + library_path);
+    }
+}
+
+compiled_script::~compiled_script()
+{
+    close_library(library);
+}
@@ -0,0 +1,55 @@
+#ifndef COMPILED_SCRIPT_H
+#define COMPILED_SCRIPT_H
+
+#include <string>
+
+#include "nodes.h"
+
+using namespace std;
+
+/*
+a script translated by transpile() and compiled into a shared library, loaded in place of its
+parsed program. the library must be built with the host's compiler and the same headers, since the
+values and the activation records cross the boundary as they are. the natives the library calls
+directly are its own copies of them: state they keep in the host, like output_stream(), is shared only
+if the host exports it to the library (e.g. linking with -rdynamic, or keeping the natives in a DLL)
+*/
+class compiled_script
+{
+    typedef void (*entry_function)(activation_record&);
+
+    void* library;
+    entry_function entry;
+
+public:
+    // loads the library and finds the entry point. throws runtime_exception if either fails
+    compiled_script(const string& library_path, const string& entry_name = "run_script");
+    compiled_script(const compiled_script&) = delete;
+    ~compiled_script();
+
+    // as program::execute: the entry point gets a record standing for the program's own one
+    void execute(activation_record& r) const
+    {
+        activation_record inner(&r);
+        entry(inner);
+    }
+
+    // as program::try_execute
+    script_result try_execute(activation_record& r) const
+    {
+        script_result result;
+        // the program's own record, reporting into result
+        activation_record checked(&r, &result);
+        try
+        {
+            entry(checked);
+        }
+        catch (const runtime_exception& ex)
+        {
+            checked.fail(ex.text);
+        }
+        return result;
+    }
+};
+
+#endif
\ No newline at end of file
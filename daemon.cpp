@@ -0,0 +1,206 @@
+#include "stdafx.h"
+#include "daemon.h"
+
+#include <chrono>
+#include <sstream>
+
+#include "parser.h"
+#include "dedup.h"
+#include "installed_functions.h"
+
+namespace
+{
+    // forwards the output of a script to the client line by line, as "out" responses
+    class line_forwarder : public streambuf
+    {
+        script_daemon& daemon;
+        const string prefix;
+        string line;
+
+    protected:
+        virtual int overflow(int c)
+        {
+            if (c == traits_type::eof())
+                return traits_type::not_eof(c);
+            if (c == '\n')
+                flush_line();
+            else
+                line += (char)c;
+            return c;
+        }
+
+    public:
+        line_forwarder(script_daemon& daemon, const string& id) : daemon(daemon), prefix("out " + id + " ")
+        {
+        }
+
+        void flush_line()
+        {
+            daemon.respond(prefix + line);
+            line.clear();
+        }
+
+        void finish()
+        {
+            if (!line.empty())
+                flush_line();
+        }
+    };
+
+    long long microseconds_between(chrono::steady_clock::time_point from, chrono::steady_clock::time_point to)
+    {
+        return chrono::duration_cast<chrono::microseconds>(to - from).count();
+    }
+}
+
+void script_daemon::serve(istream& in, ostream& out)
+{
+    p_out = &out;
+    closing = false;
+    vector<thread> workers;
+    for (int i = 0; i < nworkers; i++)
+        workers.emplace_back([this] { worker_loop(); });
+
+    string line;
+    while (getline(in, line))
+    {
+        if (line == "quit")
+            break;
+        if (line.empty())
+            continue;
+        istringstream header(line);
+        string command;
+        request rq;
+        long length = -1;
+        header >> command >> rq.id >> length;
+        if (command != "run" || rq.id.empty() || length < 0)
+        {
+            respond("error malformed request: " + line);
+            continue;
+        }
+        if ((unsigned long)length > max_script_size)
+        {
+            respond("error script too large for " + rq.id + ": " + to_string(length) + " bytes, at most " +
+                    to_string(max_script_size));
+            in.ignore(length);
+            continue;
+        }
+        rq.text.resize(length);
+        if (length > 0 && !in.read(&rq.text[0], length))
+        {
+            respond("error script text cut short for " + rq.id);
+            break;
+        }
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            queue.push_back(move(rq));
+        }
+        queue_cv.notify_one();
+    }
+
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        closing = true;
+    }
+    queue_cv.notify_all();
+    for (auto& worker : workers)
+        worker.join();
+}
+
+void script_daemon::respond(const string& line)
+{
+    lock_guard<mutex> lock(out_mutex);
+    *p_out << line << endl;
+}
+
+void script_daemon::worker_loop()
+{
+    while (true)
+    {
+        request rq;
+        {
+            unique_lock<mutex> lock(queue_mutex);
+            queue_cv.wait(lock, [this] { return closing || !queue.empty(); });
+            if (queue.empty())
+                return;
+            rq = move(queue.front());
+            queue.pop_front();
+        }
+        handle(rq);
+    }
+}
+
+shared_ptr<program> script_daemon::get_program(const string& text, bool& cached, script_result& result)
+{
+    {
+        lock_guard<mutex> lock(cache_mutex);
+        auto pentry = cache.find(text);
+        if (pentry != cache.end())
+        {
+            lru.splice(lru.end(), lru, pentry->second.second);
+            cached = true;
+            return pentry->second.first;
+        }
+    }
+
+    // parsed outside of the lock; two workers may race to parse the same text, which is harmless.
+    // defs are parsed lazily, since a cached program usually needs just a few of them
+    cached = false;
+    parser p(text, true);
+    shared_ptr<program> tree(p.try_parse(host.get_ns(), result));
+    if (!tree)
+        return nullptr;
+    // generated scripts repeat themselves a lot, and the tree stays in the cache
+    share_identical_subtrees(*tree);
+    if (cache_capacity == 0)
+        return tree;
+
+    lock_guard<mutex> lock(cache_mutex);
+    auto inserted = cache.insert(make_pair(text, make_pair(tree, lru.end())));
+    if (inserted.second)
+    {
+        inserted.first->second.second = lru.insert(lru.end(), &inserted.first->first);
+        if (cache.size() > cache_capacity)
+        {
+            // the list refers to the key inside the entry, which the erase destroys
+            string evicted = *lru.front();
+            lru.pop_front();
+            cache.erase(evicted);
+        }
+    }
+    return inserted.first->second.first;
+}
+
+void script_daemon::handle(const request& rq)
+{
+    // malformed scripts are common here, so errors are handled without exceptions
+    auto start = chrono::steady_clock::now();
+    bool cached = false;
+    script_result result;
+    shared_ptr<program> tree = get_program(rq.text, cached, result);
+    auto parsed = chrono::steady_clock::now();
+    auto parse_us = microseconds_between(start, parsed);
+    if (!tree)
+    {
+        respond("done " + rq.id + " parse_error " + to_string(result.row) + " " + to_string(result.col) + " " +
+                to_string(parse_us) + " " + result.text);
+        return;
+    }
+
+    line_forwarder forwarder(*this, rq.id);
+    ostream script_out(&forwarder);
+    auto p_saved_out = output_stream();
+    output_stream() = &script_out;
+    result = tree->try_execute(host);
+    auto exec_us = microseconds_between(parsed, chrono::steady_clock::now());
+    output_stream() = p_saved_out;
+    forwarder.finish();
+
+    if (result.status == result_status::ok)
+        respond("done " + rq.id + " ok " + to_string(cached ? 1 : 0) + " " + to_string(parse_us) + " " + to_string(exec_us));
+    else if (result.status == result_status::runtime_error)
+        respond("done " + rq.id + " runtime_error " + to_string(parse_us) + " " + to_string(exec_us) + " " + result.text);
+    else // a lazily parsed def body turned out to be malformed
+        respond("done " + rq.id + " parse_error " + to_string(result.row) + " " + to_string(result.col) + " " +
+                to_string(parse_us) + " " + result.text);
+}
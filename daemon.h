@@ -0,0 +1,84 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <string>
+#include <memory>
+#include <iostream>
+#include <list>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "nodes.h"
+
+using namespace std;
+
+/*
+long-running script server: executes the scripts it receives on a pool of workers, against one
+preconfigured host activation record. parsed programs are cached by their text, so a script sent
+again is neither re-parsed nor re-validated.
+
+protocol, line based:
+    requests
+        run <id> <length>\n<length bytes of script text>
+        quit
+    responses, one line each; requests may complete in any order
+        out <id> <text>                                 a line written by the script, as soon as it is written
+        done <id> ok <cached> <parse us> <exec us>
+        done <id> parse_error <row> <col> <parse us> <message>
+        done <id> runtime_error <parse us> <exec us> <message>
+        error <message>                                 malformed request, or a script longer than the
+                                                        maximum size, whose text is skipped
+*/
+
+class script_daemon
+{
+    struct request
+    {
+        string id;
+        string text;
+    };
+
+    activation_record& host;
+    const int nworkers;
+    // the longest script text a request may have
+    const size_t max_script_size;
+
+    ostream* p_out;
+    mutex out_mutex;
+
+    // parsed programs by script text, least recently used in front
+    mutex cache_mutex;
+    // 0 turns the cache off
+    const size_t cache_capacity;
+    list<const string*> lru;
+    unordered_map<string, pair<shared_ptr<program>, list<const string*>::iterator>> cache;
+
+    mutex queue_mutex;
+    condition_variable queue_cv;
+    deque<request> queue;
+    bool closing;
+
+    void worker_loop();
+    void handle(const request& rq);
+    shared_ptr<program> get_program(const string& text, bool& cached, script_result& result);
+
+public:
+    // the host's natives must tolerate being called from several threads at once
+    script_daemon(activation_record& host, int nworkers, size_t cache_capacity = 1024, size_t max_script_size = 1 << 24) :
+        host(host), nworkers(nworkers > 0 ? nworkers : 1), max_script_size(max_script_size), p_out(nullptr),
+        cache_capacity(cache_capacity), closing(false)
+    {
+    }
+
+    // reads requests until the end of input or "quit", returns when all of them are answered
+    void serve(istream& in, ostream& out);
+
+    // writes a response line
+    void respond(const string& line);
+};
+
+#endif
\ No newline at end of file
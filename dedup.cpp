@@ -0,0 +1,165 @@
+#include "stdafx.h"
+#include "dedup.h"
+
+#include <string>
+#include <typeinfo>
+#include <unordered_map>
+
+namespace
+{
+    class sharer
+    {
+        unordered_map<string, shared_ptr<statement>> statements;
+        unordered_map<string, shared_ptr<expr>> exprs;
+        source_map* p_positions;
+
+        template<typename T>
+        static void append(string& key, const T& field)
+        {
+            key.append(reinterpret_cast<const char*>(&field), sizeof(field));
+        }
+
+        static void append(string& key, const string& field)
+        {
+            append(key, field.length());
+            key.append(field);
+        }
+
+        // the canonical node for key, which is node itself if it is the first one with this key
+        template<typename T>
+        void intern(unordered_map<string, shared_ptr<T>>& table, const string& key, shared_ptr<T>& node)
+        {
+            auto inserted = table.insert(make_pair(key, node));
+            if (!inserted.second && inserted.first->second != node)
+            {
+                if (p_positions)
+                    p_positions->merge(node.get(), inserted.first->second.get());
+                node = inserted.first->second;
+            }
+        }
+
+        template<typename T>
+        bool constant_key(const expr* e, char tag, string& key)
+        {
+            auto pconst = dynamic_cast<const const_expr<T>*>(e);
+            if (!pconst)
+                return false;
+            key = tag;
+            append(key, pconst->pv->value);
+            return true;
+        }
+
+        void share(shared_ptr<expr>& e)
+        {
+            string key;
+            if (typeid(*e) == typeid(var))
+            {
+                key = "v";
+                append(key, static_cast<var&>(*e).name);
+            }
+            else if (!constant_key<int>(e.get(), 'i', key) &&
+                     !constant_key<chrono::seconds>(e.get(), 's', key) &&
+                     !constant_key<bool>(e.get(), 'b', key))
+            {
+                return;
+            }
+            intern(exprs, key, e);
+        }
+
+        static bool can_fault(const type_info& type)
+        {
+            return type == typeid(function_call) || type == typeid(if_statement) ||
+                   type == typeid(parallel_repeat_statement);
+        }
+
+        void share_children(vector<shared_ptr<statement>>& list, string& key)
+        {
+            for (auto& s : list)
+            {
+                share(s);
+                append(key, s.get());
+            }
+        }
+
+    public:
+        explicit sharer(source_map* p_positions) : p_positions(p_positions)
+        {
+        }
+
+        void share(shared_ptr<statement>& s)
+        {
+            if (!s)
+                return;
+            string key;
+            auto& type = typeid(*s);
+            if (type == typeid(function_call))
+            {
+                auto& call = static_cast<function_call&>(*s);
+                key = "f";
+                append(key, call.function_name);
+                append(key, call.binding.native_id);
+                // natives are called by id, wherever the call is
+                append(key, call.binding.native_id >= 0 ? 0 : call.binding.scope_hops);
+                for (auto& param : call.p_params->params)
+                {
+                    share(param);
+                    append(key, param.get());
+                }
+            }
+            else if (type == typeid(compound_statement))
+            {
+                key = "c";
+                share_children(static_cast<compound_statement&>(*s).statements, key);
+            }
+            else if (type == typeid(repeat_statement) || type == typeid(parallel_repeat_statement))
+            {
+                auto& repeat = static_cast<repeat_statement&>(*s);
+                key = type == typeid(repeat_statement) ? "r" : "p";
+                append(key, repeat.num_repeat);
+                share(repeat.p_statement);
+                append(key, repeat.p_statement.get());
+            }
+            else if (type == typeid(if_statement))
+            {
+                auto& branch = static_cast<if_statement&>(*s);
+                key = "?";
+                share(branch.p_expression);
+                append(key, branch.p_expression.get());
+                share(branch.p_statement);
+                append(key, branch.p_statement.get());
+            }
+            else if (type == typeid(def_statement))
+            {
+                auto& def = static_cast<def_statement&>(*s);
+                // a lazily parsed def parses its body, once, into itself
+                if (def.parse_body)
+                    return;
+                key = "d";
+                append(key, def.name);
+                for (auto& argname : def.argnames)
+                    append(key, argname);
+                share(def.p_statement);
+                append(key, def.p_statement.get());
+            }
+            else
+            {
+                return;
+            }
+            // a fault names its node as script_result::p_node, which has to stand for one position
+            if (p_positions != nullptr && can_fault(type))
+                return;
+            intern(statements, key, s);
+        }
+
+        void share_program(program& p)
+        {
+            string unused;
+            share_children(p.statements, unused);
+        }
+    };
+}
+
+void share_identical_subtrees(program& p, source_map* p_positions)
+{
+    sharer(p_positions).share_program(p);
+}
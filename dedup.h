@@ -0,0 +1,21 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "nodes.h"
+#include "source_map.h"
+
+/*
+hash-consing of a parsed program: structurally identical subtrees, e.g. the same call or the same
+repeat body pasted all over a generated script, are replaced by one shared node. subtrees are compared
+bottom up, by node type, fields and (already shared) children, so that the comparison is a lookup.
+nodes that have state of their own are never shared: lazily parsed defs and the program itself.
+given a source map, the shared nodes collect the positions of the nodes they replace, and the nodes
+a fault is reported by (calls, ifs and parallel repeats, see script_result::p_node) are left unshared,
+so that the map finds the one position a fault came from. without a map, p_node may be any of the
+identical occurrences.
+run it after optimize(), which needs every node to have a single place in the tree
+*/
+
+void share_identical_subtrees(program& p, source_map* p_positions = nullptr);
+
+#endif
\ No newline at end of file
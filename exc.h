@@ -14,9 +14,18 @@ struct parse_exception : exception
     int col;
     string text;
 
-    parse_exception(string text, token t) : text(text), row(t.lineno), col(t.colno)
+    parse_exception(string text, token t) : row(t.lineno), col(t.colno), text(text)
     {
     }
+
+    parse_exception(string text, int row, int col) : row(row), col(col), text(text)
+    {
+    }
+
+    virtual const char* what() const noexcept
+    {
+        return text.c_str();
+    }
 };
 
 struct runtime_exception : exception
@@ -26,6 +35,29 @@ struct runtime_exception : exception
     runtime_exception(string text) : text(text)
     {
     }
+
+    virtual const char* what() const noexcept
+    {
+        return text.c_str();
+    }
+};
+
+struct statement;
+
+enum class result_status { ok, parse_error, runtime_error };
+
+// outcome of parser::try_parse and program::try_execute, which report errors without throwing
+struct script_result
+{
+    result_status status = result_status::ok;
+    string text;
+    // position of a parse error, including one found in a lazily parsed def body at runtime
+    int row = 0;
+    int col = 0;
+    // the statement that faulted at runtime, if known
+    const statement* p_node = nullptr;
+
+    bool ok() const { return status == result_status::ok; }
 };
 
 #endif
\ No newline at end of file
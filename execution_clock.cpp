@@ -0,0 +1,235 @@
+#include "stdafx.h"
+#include "execution_clock.h"
+
+#include <future>
+#include <exception>
+
+void timer_wheel::add(unsigned long long delay, function<void()> callback)
+{
+    place(timer { current + max(delay, 1ULL), move(callback) });
+    pending++;
+}
+
+void timer_wheel::place(timer t)
+{
+    auto distance = t.expiry - current;
+    for (int level = 0; level < levels; level++)
+    {
+        if (distance < (1ULL << (level_bits * (level + 1))))
+        {
+            wheels[level][(t.expiry >> (level_bits * level)) & (slots - 1)].push_back(move(t));
+            return;
+        }
+    }
+    overflow.push_back(move(t));
+}
+
+void timer_wheel::cascade(int level)
+{
+    vector<timer> timers;
+    timers.swap(wheels[level][(current >> (level_bits * level)) & (slots - 1)]);
+    for (auto& t : timers)
+        place(move(t));
+}
+
+void timer_wheel::advance(vector<function<void()>>& expired)
+{
+    current++;
+    // the wheels that turned over, each bringing its next slot down; the upper ones go first,
+    // so that their timers can go on cascading in the same tick
+    int turned = 0;
+    while (turned < levels - 1 && (current & ((1ULL << (level_bits * (turned + 1))) - 1)) == 0)
+        turned++;
+    if (turned == levels - 1 && (current & ((1ULL << (level_bits * levels)) - 1)) == 0)
+    {
+        vector<timer> timers;
+        timers.swap(overflow);
+        for (auto& t : timers)
+            place(move(t));
+    }
+    for (int level = turned; level >= 1; level--)
+        cascade(level);
+
+    auto& due = wheels[0][current & (slots - 1)];
+    for (auto& t : due)
+        expired.push_back(move(t.callback));
+    pending -= due.size();
+    due.clear();
+}
+
+void timer_wheel::advance_to(unsigned long long tick, vector<function<void()>>& expired)
+{
+    if (pending == 0)
+    {
+        current = max(current, tick);
+        return;
+    }
+    while (current < tick)
+        advance(expired);
+}
+
+real_time_clock::real_time_clock(chrono::milliseconds tick) :
+    tick(tick), start(chrono::steady_clock::now()), ticker([this] { run(); })
+{
+}
+
+real_time_clock::~real_time_clock()
+{
+    {
+        lock_guard<mutex> lock(wheel_mutex);
+        closing = true;
+    }
+    wheel_cv.notify_all();
+    ticker.join();
+}
+
+void real_time_clock::run()
+{
+    vector<function<void()>> expired;
+    unique_lock<mutex> lock(wheel_mutex);
+    while (!closing)
+    {
+        if (wheel.size() == 0)
+        {
+            wheel_cv.wait(lock, [this] { return closing || wheel.size() > 0; });
+            continue;
+        }
+        wheel_cv.wait_until(lock, start + tick * (long long)(wheel.now() + 1), [this] { return closing; });
+        if (closing)
+            break;
+        wheel.advance_to((chrono::steady_clock::now() - start) / tick, expired);
+        // the callbacks may schedule timers of their own
+        lock.unlock();
+        for (auto& callback : expired)
+            callback();
+        expired.clear();
+        lock.lock();
+    }
+}
+
+void real_time_clock::schedule(chrono::milliseconds delay, function<void()> callback)
+{
+    {
+        lock_guard<mutex> lock(wheel_mutex);
+        // after a time without timers the wheel stands still; it jumps to the present first. with timers
+        // pending it is the ticker's to turn, as the timers it passes have to be run
+        auto elapsed = chrono::steady_clock::now() - start;
+        if (wheel.size() == 0)
+        {
+            vector<function<void()>> none;
+            wheel.advance_to(elapsed / tick, none);
+        }
+        // the first tick at or after the deadline. the wheel is behind the present while the ticker
+        // catches up, e.g. after a slow callback
+        unsigned long long due = (elapsed + delay + tick - chrono::nanoseconds(1)) / tick;
+        wheel.add(due > wheel.now() ? due - wheel.now() : 1, move(callback));
+    }
+    wheel_cv.notify_all();
+}
+
+void real_time_clock::pause(chrono::milliseconds duration)
+{
+    if (duration <= chrono::milliseconds(0))
+        return;
+    // shared with the callback, which may still be inside set_value when the pause is over
+    auto p_woken = make_shared<promise<void>>();
+    auto woken = p_woken->get_future();
+    schedule(duration, [p_woken] { p_woken->set_value(); });
+    woken.wait();
+}
+
+chrono::milliseconds real_time_clock::now() const
+{
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+}
+
+namespace
+{
+    // the virtual clock, and the script of it, that the current thread runs
+    thread_local const virtual_clock* p_thread_clock = nullptr;
+    thread_local int thread_script = -1;
+}
+
+void virtual_clock::dispatch_next()
+{
+    if (waiting.empty())
+    {
+        if (finished == (int)scripts.size())
+            done_cv.notify_all();
+        return;
+    }
+    auto next = waiting.top();
+    waiting.pop();
+    current = max(current, next.time);
+    scripts[next.script]->running = true;
+    scripts[next.script]->cv.notify_one();
+}
+
+void virtual_clock::run(const vector<function<void()>>& bodies)
+{
+    vector<thread> threads;
+    exception_ptr error;
+    unique_lock<mutex> lock(clock_mutex);
+    scripts.clear();
+    finished = 0;
+    for (size_t i = 0; i < bodies.size(); i++)
+    {
+        scripts.emplace_back(new script_state());
+        waiting.push(wakeup { current, next_seq++, (int)i });
+    }
+    for (size_t i = 0; i < bodies.size(); i++)
+    {
+        threads.emplace_back([this, &bodies, &error, i]
+        {
+            auto& state = *scripts[i];
+            {
+                unique_lock<mutex> lock(clock_mutex);
+                state.cv.wait(lock, [&] { return state.running; });
+            }
+            p_thread_clock = this;
+            thread_script = i;
+            try
+            {
+                bodies[i]();
+            }
+            catch (...)
+            {
+                lock_guard<mutex> lock(clock_mutex);
+                if (!error)
+                    error = current_exception();
+            }
+            lock_guard<mutex> lock(clock_mutex);
+            state.running = false;
+            finished++;
+            dispatch_next();
+        });
+    }
+    dispatch_next();
+    done_cv.wait(lock, [&] { return finished == (int)bodies.size(); });
+    lock.unlock();
+    for (auto& t : threads)
+        t.join();
+    if (error)
+        rethrow_exception(error);
+}
+
+void virtual_clock::pause(chrono::milliseconds duration)
+{
+    unique_lock<mutex> lock(clock_mutex);
+    if (p_thread_clock != this)
+    {
+        current += max(duration, chrono::milliseconds(0));
+        return;
+    }
+    auto& state = *scripts[thread_script];
+    waiting.push(wakeup { current + max(duration, chrono::milliseconds(0)), next_seq++, thread_script });
+    state.running = false;
+    dispatch_next();
+    state.cv.wait(lock, [&] { return state.running; });
+}
+
+chrono::milliseconds virtual_clock::now() const
+{
+    lock_guard<mutex> lock(clock_mutex);
+    return current;
+}
@@ -0,0 +1,145 @@
+#ifndef EXECUTION_CLOCK_H
+#define EXECUTION_CLOCK_H
+
+#include <vector>
+#include <queue>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+// the time scripts pause in. installed into an activation record, it is used by f_pause of the
+// record and its inner records; without one, pauses don't wait at all
+class execution_clock
+{
+public:
+    // blocks the calling script for the given time of this clock
+    virtual void pause(chrono::milliseconds duration) = 0;
+    // the time since the clock started
+    virtual chrono::milliseconds now() const = 0;
+    virtual ~execution_clock() { }
+};
+
+/*
+hierarchical timer wheel: timers are kept in slots of `levels` wheels of `slots` each, the wheel of level l
+covering delays up to slots^(l+1) ticks. whenever a wheel turns over, the next slot of the wheel above is
+cascaded down into it. adding a timer and expiring one are O(1), however many timers are pending;
+every timer is cascaded at most levels - 1 times. timers further out than the top wheel wait in an
+overflow list, which is redistributed each time the top wheel turns over.
+not thread safe
+*/
+class timer_wheel
+{
+    static const int level_bits = 6;
+    static const int levels = 4;
+    static const int slots = 1 << level_bits;
+
+    struct timer
+    {
+        unsigned long long expiry;
+        function<void()> callback;
+    };
+
+    vector<timer> wheels[levels][slots];
+    vector<timer> overflow;
+    unsigned long long current = 0;
+    size_t pending = 0;
+
+    void place(timer t);
+    void cascade(int level);
+
+public:
+    // the callback is returned by the advance reaching current tick + delay. the delay is at least one tick
+    void add(unsigned long long delay, function<void()> callback);
+    // advances the wheel by one tick, appending the callbacks of the timers expiring at the new tick
+    void advance(vector<function<void()>>& expired);
+    // advances to the given tick; with no timers pending the wheel jumps there right away
+    void advance_to(unsigned long long tick, vector<function<void()>>& expired);
+
+    unsigned long long now() const
+    {
+        return current;
+    }
+
+    size_t size() const
+    {
+        return pending;
+    }
+};
+
+// wall clock time: pauses are timers on a timer wheel, turned by a thread of the clock
+class real_time_clock : public execution_clock
+{
+    const chrono::milliseconds tick;
+    const chrono::steady_clock::time_point start;
+    timer_wheel wheel;
+    mutable mutex wheel_mutex;
+    condition_variable wheel_cv;
+    bool closing = false;
+    thread ticker;
+
+    void run();
+
+public:
+    explicit real_time_clock(chrono::milliseconds tick = chrono::milliseconds(10));
+    real_time_clock(const real_time_clock&) = delete;
+    ~real_time_clock();
+
+    // calls the callback on the clock's thread once the delay (rounded up to whole ticks) has passed
+    void schedule(chrono::milliseconds delay, function<void()> callback);
+
+    virtual void pause(chrono::milliseconds duration);
+    virtual chrono::milliseconds now() const;
+};
+
+/*
+simulated time, which jumps from one pause to the next instead of passing. run() executes a set of scripts,
+each on a thread of its own, but only one at a time: a script runs until it pauses or ends, and then the
+script with the earliest wake-up time continues, ties going to the one that paused first. the interleaving
+of the scripts, and with it their combined output, is the same on every run
+*/
+class virtual_clock : public execution_clock
+{
+    struct wakeup
+    {
+        chrono::milliseconds time;
+        unsigned long long seq;
+        int script;
+
+        bool operator>(const wakeup& other) const
+        {
+            return time != other.time ? time > other.time : seq > other.seq;
+        }
+    };
+
+    struct script_state
+    {
+        condition_variable cv;
+        bool running = false;
+    };
+
+    mutable mutex clock_mutex;
+    chrono::milliseconds current{ 0 };
+    unsigned long long next_seq = 0;
+    priority_queue<wakeup, vector<wakeup>, greater<wakeup>> waiting;
+    vector<unique_ptr<script_state>> scripts;
+    int finished = 0;
+    condition_variable done_cv;
+
+    void dispatch_next();
+
+public:
+    // runs the scripts to their end in simulated time. the clock keeps its time between runs
+    void run(const vector<function<void()>>& scripts);
+
+    // from a script of run(): lets the other scripts run until the pause is over.
+    // from anywhere else: just moves the time forward
+    virtual void pause(chrono::milliseconds duration);
+    virtual chrono::milliseconds now() const;
+};
+
+#endif
\ No newline at end of file
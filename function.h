@@ -11,10 +11,26 @@ using namespace std;
 
 class activation_record;
 
+// properties of a native, declared by the host when installing it
+enum native_attributes
+{
+    na_none = 0,
+    // the native depends on something besides its arguments (e.g. the activation record it is called with),
+    // so its calls cannot be recorded into a trace and replayed later
+    na_impure = 1,
+    // the native may be called from several threads at once, and the order of its calls does not matter.
+    // a parallel repeat calls such natives, and such host functions of inner records, right away
+    // instead of buffering them
+    na_thread_safe = 2,
+};
+
 struct installed_function
 {
     std::function<void(const activation_record&, const std::vector<shared_ptr<value>>&)> function;
     int argnum;
+    unsigned attributes = na_none;
+    // installed by a def of the script rather than by the host
+    bool defined_by_script = false;
 };
 
 #endif
\ No newline at end of file
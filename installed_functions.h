@@ -10,51 +10,71 @@
 
 #include "value.h"
 #include "exc.h"
+#include "native_table.h"
+#include "execution_clock.h"
 
 using namespace std;
 
-inline void f_pause(const activation_record&, const vector<shared_ptr<value>>& args)
+// the stream the natives write to. a host running scripts on several threads can redirect it per thread
+inline ostream*& output_stream()
+{
+    thread_local ostream* p_out = &cout;
+    return p_out;
+}
+
+inline void f_pause(const activation_record& r, const vector<shared_ptr<value>>& args)
 {
     auto parg = dynamic_cast<typed_value<chrono::seconds>*>(args[0].get());
     if (!parg)
-        throw runtime_exception("argument type mismatch in function pause");
+        return r.fail("argument type mismatch in function pause");
     auto duration = parg->value;
-    cout << "pause: " << duration.count() << " seconds" << endl;
+    *output_stream() << "pause: " << duration.count() << " seconds" << endl;
+    if (r.get_clock() != nullptr)
+        r.get_clock()->pause(duration);
 }
 
-inline void f_click(const activation_record&, const vector<shared_ptr<value>>& args)
+inline void f_click(const activation_record& r, const vector<shared_ptr<value>>& args)
 {
     auto parg1 = dynamic_cast<typed_value<int>*>(args[0].get());
     auto parg2 = dynamic_cast<typed_value<int>*>(args[1].get());
     if (!parg1 || !parg2)
-        throw runtime_exception("argument type mismatch in function click");
+        return r.fail("argument type mismatch in function click");
     auto x = parg1->value;
     auto y = parg2->value;
-    cout << "click: (" << x << ", " << y << ")" << endl;
+    *output_stream() << "click: (" << x << ", " << y << ")" << endl;
 }
 
-inline void f_dump(const activation_record&, const vector<shared_ptr<value>>& args)
+inline void f_dump(const activation_record& r, const vector<shared_ptr<value>>& args)
 {
-    cout << "dump: ";
+    auto& out = *output_stream();
+    out << "dump: ";
     bool first = true;
     for (auto& arg : args)
     {
         auto parg = arg.get();
         if (!parg)
-            throw runtime_exception("impossible: no arg value");
+            return r.fail("impossible: no arg value");
         if (!first)
-            cout << ", ";
+            out << ", ";
         auto pintarg = dynamic_cast<typed_value<int>*>(parg);
         if (pintarg)
-            cout << pintarg->value << " (int)" << endl;
+            out << pintarg->value << " (int)" << endl;
         auto ptimearg = dynamic_cast<typed_value<chrono::seconds>*>(parg);
         if (ptimearg)
-            cout << ptimearg->value.count() << "s (time)" << endl;
+            out << ptimearg->value.count() << "s (time)" << endl;
         auto pboolarg = dynamic_cast<typed_value<bool>*>(parg);
         if (pboolarg)
-            cout << boolalpha << pboolarg->value << " (bool)" << endl;
+            out << boolalpha << pboolarg->value << " (bool)" << endl;
         first = false;
     }
 }
 
+// the natives above, for hosts installing them at once with activation_record::install_natives
+constexpr native_descriptor builtin_natives[] =
+{
+    { "pause", 1, f_pause, na_none },
+    { "click", 2, f_click, na_none },
+    { "dump", 1, f_dump, na_none },
+};
+
 #endif
\ No newline at end of file
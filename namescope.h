@@ -3,53 +3,131 @@
 
 #include <unordered_map>
 #include <unordered_set>
+#include <limits>
+#include <atomic>
+
+#include "exc.h"
+#include "native_table.h"
+
+// where a function call will find its function at runtime
+struct function_binding
+{
+    // index in the host's native table, or -1 for functions defined by the script
+    int native_id;
+    // for script functions: how many activation records up from the call site the function lives
+    int scope_hops;
+};
 
 class namescope
 {
+    struct signature
+    {
+        int argnum;
+        // every declaration remembers its index in this scope, so that a scope can be looked at
+        // as it was at some earlier point of parsing (needed for deferred parsing of function bodies)
+        int declaration;
+        int native_id;
+    };
+
     const namescope* p_outer;
-    unordered_map<string, int> function_signatures;
-    unordered_set<string> vars;
+    unordered_map<string, signature> function_signatures;
+    unordered_map<string, int> vars; // name -> declaration index
+    int declarations = 0;
+    // only the first outer_limit declarations of the outer scope are visible from this one
+    int outer_limit = numeric_limits<int>::max();
     bool owns_outer_scope = false;
+    // a host's natives, looked up in the table itself instead of being copied into function_signatures.
+    // they count as declared before everything else on this level
+    const native_table* p_native_table = nullptr;
+    int native_table_base = 0;
+
+    bool find_function(const string& name, int limit, signature& sig) const
+    {
+        auto psig = function_signatures.find(name);
+        if (psig != function_signatures.end())
+        {
+            sig = psig->second;
+            return sig.declaration < limit;
+        }
+        int index = p_native_table != nullptr ? p_native_table->find(name) : -1;
+        if (index < 0)
+            return false;
+        sig.argnum = p_native_table->descriptor(index).argnum;
+        sig.declaration = -1;
+        sig.native_id = native_table_base + index;
+        return true;
+    }
 
 public:
     namescope() : p_outer(nullptr) { }
     namescope(const namescope* outer) : p_outer(outer) { }
+    namescope(const namescope* outer, int outer_limit) : p_outer(outer), outer_limit(outer_limit) { }
+    explicit namescope(unique_ptr<namescope> owned_outer) : p_outer(owned_outer.release()), owns_outer_scope(true) { }
     namescope(const namescope&) = delete;
 
     enum class lookup_result { not_found, wrong_signature, found };
 
-    lookup_result lookup_func(string name, int nargs) const
+    lookup_result lookup_func(const string& name, int nargs, function_binding* p_binding = nullptr,
+                              int limit = numeric_limits<int>::max()) const
     {
-        auto psig = function_signatures.find(name);
-        auto found = psig != function_signatures.end();
-        if (found && psig->second == nargs)
+        signature sig;
+        auto found = find_function(name, limit, sig);
+        if (found && sig.argnum == nargs)
+        {
+            if (p_binding)
+            {
+                p_binding->native_id = sig.native_id;
+                p_binding->scope_hops = 0;
+            }
             return lookup_result::found;
+        }
         if (p_outer != nullptr)
         {
-            auto outer_result = p_outer->lookup_func(name, nargs);
+            auto outer_result = p_outer->lookup_func(name, nargs, p_binding, outer_limit);
+            if (outer_result == lookup_result::found && p_binding)
+                p_binding->scope_hops++;
             if (outer_result != lookup_result::not_found)
                 return outer_result;
         }
         return found ? lookup_result::wrong_signature : lookup_result::not_found;
     }
 
-    lookup_result lookup_var(string name) const
+    lookup_result lookup_var(const string& name, int limit = numeric_limits<int>::max()) const
     {
-        if (vars.find(name) != vars.end())
+        auto pvar = vars.find(name);
+        if (pvar != vars.end() && pvar->second < limit)
             return lookup_result::found;
         if (p_outer != nullptr)
-            return p_outer->lookup_var(name);
+            return p_outer->lookup_var(name, outer_limit);
         return lookup_result::not_found;
     }
 
-    void install_function(string name, int argnum)
+    void install_function(string name, int argnum, int native_id = -1)
+    {
+        // the table's natives were declared first
+        if (p_native_table != nullptr && p_native_table->find(name) >= 0)
+            return;
+        signature sig = { argnum, declarations, native_id };
+        if (function_signatures.insert(make_pair(name, sig)).second)
+            declarations++;
+    }
+
+    // the natives of the table get the ids base, base + 1, ... in table order. one table per scope
+    void install_natives(const native_table* p_table, int base)
     {
-        function_signatures.insert(make_pair(name, argnum));
+        p_native_table = p_table;
+        native_table_base = base;
     }
 
     void install_var(string name)
     {
-        vars.insert(name);
+        if (vars.insert(make_pair(name, declarations)).second)
+            declarations++;
+    }
+
+    int declaration_count() const
+    {
+        return declarations;
     }
 
     namescope* clone() const
@@ -58,7 +136,36 @@ public:
         if (p_outer != nullptr)
             r->p_outer = p_outer->clone();
         r->function_signatures = function_signatures;
+        r->vars = vars;
+        r->declarations = declarations;
+        r->outer_limit = outer_limit;
         r->owns_outer_scope = true;
+        r->p_native_table = p_native_table;
+        r->native_table_base = native_table_base;
+        return r;
+    }
+
+    // copies the scope chain from this scope up to shared_scope (exclusive). shared_scope itself is
+    // referenced, not copied, and the copy keeps seeing it as it is now. this must be an inner scope
+    // of shared_scope, and shared_scope must outlive the copy
+    namescope* copy_until(const namescope* shared_scope) const
+    {
+        namescope* r = new namescope();
+        r->function_signatures = function_signatures;
+        r->vars = vars;
+        r->declarations = declarations;
+        r->p_native_table = p_native_table;
+        r->native_table_base = native_table_base;
+        if (p_outer == shared_scope)
+        {
+            r->p_outer = shared_scope;
+            r->outer_limit = shared_scope->declarations;
+        }
+        else
+        {
+            r->p_outer = p_outer->copy_until(shared_scope);
+            r->owns_outer_scope = true;
+        }
         return r;
     }
 
@@ -69,24 +176,104 @@ public:
     }
 };
 
+class execution_clock;
+
+// replaces the host functions that calls find by scope_hops, e.g. by functions buffering the calls
+typedef function<const installed_function*(const installed_function*)> host_function_redirect;
+
 class activation_record
 {
     const activation_record* p_outer;
     unordered_map<string, shared_ptr<installed_function>> functions;
     unordered_map<string, shared_ptr<value>> vars;
     namescope ns;
+    // dense table of the host's natives, indexed by native id. owned by the root record
+    vector<const installed_function*> natives;
+    const vector<const installed_function*>* p_natives;
+    // where runtime errors go when executing without exceptions, nullptr when they are thrown
+    script_result* p_result;
+    // the time pauses are made in, inherited by inner records
+    execution_clock* p_clock;
+    // applied to the host functions found by scope_hops, inherited by inner records; nullptr calls them as they are
+    const host_function_redirect* p_redirect;
+    // unique for the lifetime of the process, unlike the address of the record
+    unsigned long long serial;
+
+    static unsigned long long next_serial()
+    {
+        static atomic<unsigned long long> counter(1);
+        return counter.fetch_add(1, memory_order_relaxed);
+    }
 
 public:
-    activation_record() { }
-    activation_record(const activation_record* outer) : p_outer(outer) { }
+    activation_record() :
+        p_outer(nullptr), p_natives(&natives), p_result(nullptr), p_clock(nullptr), p_redirect(nullptr),
+        serial(next_serial()) { }
+    // the namescope of an inner record continues in the outer record's one, so that a script parsed against
+    // the inner record's namescope and executed in it finds the functions of the outer records too
+    activation_record(const activation_record* outer) :
+        p_outer(outer), ns(&outer->ns), p_natives(outer->p_natives), p_result(outer->p_result), p_clock(outer->p_clock),
+        p_redirect(outer->p_redirect), serial(next_serial()) { }
+    // looks up names in outer, but executes in the context (natives, error reporting) of another record
+    activation_record(const activation_record* outer, const activation_record& context) :
+        p_outer(outer), ns(&outer->ns), p_natives(context.p_natives), p_result(context.p_result), p_clock(context.p_clock),
+        p_redirect(context.p_redirect), serial(next_serial()) { }
+    // the record and its inner records call natives through the given table instead of the root's one
+    activation_record(const activation_record* outer, const vector<const installed_function*>* p_natives) :
+        p_outer(outer), ns(&outer->ns), p_natives(p_natives), p_result(outer->p_result), p_clock(outer->p_clock),
+        p_redirect(outer->p_redirect), serial(next_serial()) { }
+    // the record and its inner records report runtime errors into result instead of throwing
+    activation_record(const activation_record* outer, script_result* p_result) :
+        p_outer(outer), ns(&outer->ns), p_natives(outer->p_natives), p_result(p_result), p_clock(outer->p_clock),
+        p_redirect(outer->p_redirect), serial(next_serial()) { }
+    // both of the above
+    activation_record(const activation_record* outer, const vector<const installed_function*>* p_natives,
+                      script_result* p_result) :
+        p_outer(outer), ns(&outer->ns), p_natives(p_natives), p_result(p_result), p_clock(outer->p_clock),
+        p_redirect(outer->p_redirect), serial(next_serial()) { }
     activation_record(const activation_record&) = delete;
 
-    void install_function(function<void(const activation_record&, const vector<shared_ptr<value>>&)> f, int argnum, string name)
+    // installs a host function. functions installed into the root record get a native id, which
+    // the parser binds the call sites to
+    void install_function(function<void(const activation_record&, const vector<shared_ptr<value>>&)> f, int argnum, string name,
+                          unsigned attributes = na_none)
+    {
+        installed_function* pf = new installed_function;
+        pf->function = f;
+        pf->argnum = argnum;
+        pf->attributes = attributes;
+        int native_id = -1;
+        if (functions.insert(make_pair(name, shared_ptr<installed_function>(pf))).second && p_outer == nullptr)
+        {
+            native_id = natives.size();
+            natives.push_back(pf);
+        }
+        ns.install_function(name, argnum, native_id);
+    }
+
+    // installs a host's fixed set of natives at once, into the root record. the table is referenced, not copied,
+    // by the record and the namescopes parsed against it, so it must outlive them. the natives are called
+    // by id like the others, but get_func doesn't find them
+    void install_natives(const native_table& table)
+    {
+        ns.install_natives(&table, natives.size());
+        for (size_t i = 0; i < table.size(); i++)
+            natives.push_back(&table.function(i));
+    }
+
+    // installs a function defined by the script, which is found by its call sites through scope_hops
+    void install_script_function(function<void(const activation_record&, const vector<shared_ptr<value>>&)> f, int argnum, string name)
     {
         installed_function* pf = new installed_function;
         pf->function = f;
         pf->argnum = argnum;
+        pf->defined_by_script = true;
         functions.insert(make_pair(name, shared_ptr<installed_function>(pf)));
+    }
+
+    // makes a function installed with install_script_function known to scripts parsed against get_ns()
+    void declare_script_function(const string& name, int argnum)
+    {
         ns.install_function(name, argnum);
     }
 
@@ -96,7 +283,7 @@ public:
         ns.install_var(name);
     }
 
-    shared_ptr<installed_function> get_func(string name) const
+    shared_ptr<installed_function> get_func(const string& name) const
     {
         auto pfunc = functions.find(name);
         if (pfunc != functions.end())
@@ -104,9 +291,100 @@ public:
         if (p_outer != nullptr)
             return p_outer->get_func(name);
         return nullptr;
-	}
+    }
+
+    const installed_function* get_native(int native_id) const
+    {
+        return (*p_natives)[native_id];
+    }
+
+    const vector<const installed_function*>& get_natives() const
+    {
+        return *p_natives;
+    }
+
+    // the function installed in exactly this record, if any
+    const installed_function* get_local_func(const string& name) const
+    {
+        auto pfunc = functions.find(name);
+        return pfunc != functions.end() ? pfunc->second.get() : nullptr;
+    }
+
+    const activation_record* get_outer(int hops) const
+    {
+        const activation_record* r = this;
+        for (int i = 0; i < hops && r != nullptr; i++)
+            r = r->p_outer;
+        return r;
+    }
+
+    // reports a runtime error; natives use it too. throws runtime_exception, unless executing with
+    // program::try_execute: then the first error is kept, and the statements unwind checking failed()
+    void fail(const string& text, const statement* p_node = nullptr) const
+    {
+        if (p_result == nullptr)
+            throw runtime_exception(text);
+        if (p_result->ok())
+        {
+            p_result->status = result_status::runtime_error;
+            p_result->text = text;
+            p_result->p_node = p_node;
+        }
+    }
+
+    // reports a parse error found at runtime, in a lazily parsed def body
+    void fail(const script_result& parse_error) const
+    {
+        if (p_result == nullptr)
+            throw parse_exception(parse_error.text, parse_error.row, parse_error.col);
+        if (p_result->ok())
+            *p_result = parse_error;
+    }
+
+    bool failed() const
+    {
+        return p_result != nullptr && !p_result->ok();
+    }
+
+    // attributes an error reported by a native to the calling statement
+    void set_fault_node(const statement* p_node) const
+    {
+        if (p_result != nullptr && p_result->p_node == nullptr)
+            p_result->p_node = p_node;
+    }
+
+    // the record and the records created under it afterwards pause in the given clock's time
+    void set_clock(execution_clock* p_new_clock)
+    {
+        p_clock = p_new_clock;
+    }
+
+    execution_clock* get_clock() const
+    {
+        return p_clock;
+    }
+
+    // the record and the records created under it afterwards call the host functions found by scope_hops
+    // through the redirect. natives are replaced through the natives table instead
+    void redirect_host_functions(const host_function_redirect* p_new_redirect)
+    {
+        p_redirect = p_new_redirect;
+    }
+
+    // the function a call found by scope_hops is to call
+    const installed_function* redirected(const installed_function* p_function) const
+    {
+        if (p_function == nullptr || p_redirect == nullptr || p_function->defined_by_script)
+            return p_function;
+        return (*p_redirect)(p_function);
+    }
+
+    unsigned long long get_serial() const
+    {
+        return serial;
+    }
 
-    shared_ptr<value> get_var(string name) const
+    shared_ptr<value> get_var(const string& name) const
     {
         auto pvar = vars.find(name);
         if (pvar != vars.end())
@@ -116,7 +394,7 @@ public:
         return nullptr;
     }
 
-    const namescope& get_ns()
+    const namescope& get_ns() const
     {
         return ns;
     }
@@ -0,0 +1,86 @@
+#include "stdafx.h"
+#include "native_table.h"
+
+#include <cstring>
+#include <algorithm>
+#include <unordered_set>
+
+native_table::native_table(const native_descriptor* begin, const native_descriptor* end)
+{
+    unordered_set<string> names;
+    for (auto pd = begin; pd != end; ++pd)
+    {
+        if (!names.insert(pd->name).second)
+            continue;
+        descriptors.push_back(*pd);
+        installed_function f;
+        f.function = pd->function;
+        f.argnum = pd->argnum;
+        f.attributes = pd->attributes;
+        functions.push_back(f);
+    }
+
+    size_t n = descriptors.size();
+    if (n == 0)
+        return;
+
+    // hash and displace: the buckets are placed largest first, each with the first seed that puts
+    // all of its names into free slots
+    vector<vector<int>> buckets(n);
+    for (size_t i = 0; i < n; i++)
+        buckets[hash(descriptors[i].name, strlen(descriptors[i].name), 0) % n].push_back(i);
+    vector<int> order(n);
+    for (size_t b = 0; b < n; b++)
+        order[b] = b;
+    stable_sort(order.begin(), order.end(), [&](int a, int b) { return buckets[a].size() > buckets[b].size(); });
+
+    seeds.assign(n, 0);
+    slots.assign(n, -1);
+    vector<size_t> placed;
+    for (int b : order)
+    {
+        auto& bucket = buckets[b];
+        if (bucket.empty())
+            break;
+        for (unsigned seed = 1; ; seed++)
+        {
+            placed.clear();
+            for (int i : bucket)
+            {
+                size_t slot = hash(descriptors[i].name, strlen(descriptors[i].name), seed) % n;
+                if (slots[slot] >= 0 || std::find(placed.begin(), placed.end(), slot) != placed.end())
+                    break;
+                placed.push_back(slot);
+            }
+            if (placed.size() == bucket.size())
+            {
+                for (size_t k = 0; k < bucket.size(); k++)
+                    slots[placed[k]] = bucket[k];
+                seeds[b] = seed;
+                break;
+            }
+        }
+    }
+}
+
+unsigned native_table::hash(const char* name, size_t length, unsigned seed)
+{
+    // FNV-1a, started from the seed
+    unsigned h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (size_t i = 0; i < length; i++)
+    {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+int native_table::find(const string& name) const
+{
+    size_t n = descriptors.size();
+    if (n == 0)
+        return -1;
+    unsigned seed = seeds[hash(name.data(), name.length(), 0) % n];
+    int index = slots[hash(name.data(), name.length(), seed) % n];
+    return index >= 0 && name == descriptors[index].name ? index : -1;
+}
@@ -0,0 +1,69 @@
+#ifndef NATIVE_TABLE_H
+#define NATIVE_TABLE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "value.h"
+#include "function.h"
+
+using namespace std;
+
+// a native as a host describes it in a constexpr array:
+//     constexpr native_descriptor my_natives[] = { { "pause", 1, f_pause, na_none }, { "work", 1, f_work, na_thread_safe } };
+struct native_descriptor
+{
+    const char* name;
+    int argnum;
+    void (*function)(const activation_record&, const vector<shared_ptr<value>>&);
+    unsigned attributes;
+};
+
+/*
+a host's fixed set of natives, found by name through a perfect hash: the name picks a bucket, the
+bucket's seed picks the slot, and one string comparison confirms the match. the hash is built once,
+when the table is constructed: finding the seeds is a search, which the constexpr rules of our
+compiler (one return statement per function, no loops) cannot express for tables of realistic size.
+of several natives with the same name, the first one is kept
+*/
+class native_table
+{
+    vector<native_descriptor> descriptors;
+    vector<installed_function> functions;
+    vector<unsigned> seeds;
+    // slot -> index in descriptors
+    vector<int> slots;
+
+    static unsigned hash(const char* name, size_t length, unsigned seed);
+
+public:
+    native_table(const native_descriptor* begin, const native_descriptor* end);
+
+    template<size_t N>
+    explicit native_table(const native_descriptor (&table)[N]) : native_table(table, table + N)
+    {
+    }
+
+    native_table(const native_table&) = delete;
+
+    // the index of the native with the given name, -1 if there is none
+    int find(const string& name) const;
+
+    size_t size() const
+    {
+        return descriptors.size();
+    }
+
+    const native_descriptor& descriptor(int index) const
+    {
+        return descriptors[index];
+    }
+
+    const installed_function& function(int index) const
+    {
+        return functions[index];
+    }
+};
+
+#endif
\ No newline at end of file
@@ -2,13 +2,21 @@
 #define NODES_H
 
 #include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <exception>
 #include "value.h"
 #include "function.h"
 #include "namescope.h"
 #include "exc.h"
+#include "work_pool.h"
 
 using namespace std;
 
+// nodes hold their children by shared_ptr: share_identical_subtrees (dedup.h) makes identical subtrees
+// one, so a node can have several parents
 struct expr
 {
     virtual shared_ptr<value> evaluate(activation_record& r) = 0;
@@ -31,19 +39,23 @@ struct var : public expr
     {
         auto pvar = r.get_var(name);
         if (pvar == nullptr)
-            throw runtime_exception("impossible: cannot find variable in name scope");
+            r.fail("impossible: cannot find variable in name scope");
         return pvar;
     }
 };
 
 struct paramlist
 {
-    std::vector<std::unique_ptr<expr>> params;
+    std::vector<std::shared_ptr<expr>> params;
     arglist evaluate(activation_record& r)
     {
         arglist l;
         for (auto& param : params)
+        {
             l.args.emplace_back(param->evaluate(r));
+            if (!l.args.back())
+                break;
+        }
         return l;
     }
 };
@@ -63,48 +75,231 @@ struct function_call : public statement
 {
     string function_name;
     unique_ptr<paramlist> p_params;
+    // bound by the parser: natives are called through the host's native table,
+    // script functions are looked up in the record scope_hops levels up
+    function_binding binding;
+    // the script function found last time, valid as long as it is looked up in the same record.
+    // a program can be executed on several threads at once, so the cache is guarded by a sequence
+    // lock: an odd version means an update is in progress, and a reader retries from scratch
+    // if the version changed under it
+    atomic<unsigned> cache_version{ 0 };
+    atomic<unsigned long long> cached_serial{ 0 };
+    atomic<const installed_function*> p_cached{ nullptr };
 
     virtual void execute(activation_record& r)
     {
-        auto p_function = r.get_func(function_name);
+        auto p_function = binding.native_id >= 0 ? r.get_native(binding.native_id) : r.redirected(resolve(r));
         if (p_function == nullptr)
-            throw runtime_exception("impossible: cannot find function in name scope");
+            return r.fail("impossible: cannot find function in name scope", this);
         arglist arglist(p_params->evaluate(r));
+        if (r.failed())
+            return r.set_fault_node(this);
         p_function->function(r, arglist.args);
+        if (r.failed())
+            r.set_fault_node(this);
+    }
+
+    const installed_function* resolve(const activation_record& r)
+    {
+        auto p_owner = r.get_outer(binding.scope_hops);
+        if (p_owner == nullptr)
+            return nullptr;
+        auto serial = p_owner->get_serial();
+
+        unsigned version = cache_version.load(memory_order_acquire);
+        if ((version & 1) == 0 && cached_serial.load(memory_order_relaxed) == serial)
+        {
+            auto p_function = p_cached.load(memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            if (cache_version.load(memory_order_relaxed) == version)
+                return p_function;
+        }
+
+        auto p_function = p_owner->get_local_func(function_name);
+        // if another thread is updating the cache, just don't cache this time
+        if ((version & 1) == 0 && cache_version.compare_exchange_strong(version, version + 1, memory_order_acquire))
+        {
+            atomic_thread_fence(memory_order_release);
+            cached_serial.store(serial, memory_order_relaxed);
+            p_cached.store(p_function, memory_order_relaxed);
+            cache_version.store(version + 2, memory_order_release);
+        }
+        return p_function;
     }
 };
 
 struct compound_statement : public statement
 {
-    vector<unique_ptr<statement>> statements;
+    vector<shared_ptr<statement>> statements;
     virtual void execute(activation_record& r)
     {
         activation_record inner(&r);
+        execute_in(inner);
+    }
+
+    // runs the statements in the given record instead of a record of their own. the record stands for the
+    // compound's own one, so it must be an inner record of the one execute would get: the call sites are
+    // bound by counting the records up from there
+    void execute_in(activation_record& inner)
+    {
         for (auto& p_statement : statements)
+        {
             p_statement->execute(inner);
+            if (inner.failed())
+                return;
+        }
     }
 };
 
 struct repeat_statement : public statement
 {
-    unique_ptr<statement> p_statement;
+    shared_ptr<statement> p_statement;
     long num_repeat;
     virtual void execute(activation_record& r)
     {
         for (long i = 0; i < num_repeat; i++)
+        {
             p_statement->execute(r);
+            if (r.failed())
+                return;
+        }
+    }
+};
+
+// runs the iterations on the shared work pool. natives and host functions declared na_thread_safe are
+// called right away on the worker threads; the calls of the others are buffered per iteration, and made in
+// iteration order once all iterations are done, so that their output comes out as from a plain repeat.
+// buffered calls are made with the record of the parallel repeat, not of their iteration.
+// host functions go through the redirect of the parallel repeat's record first, so that e.g. an enclosing
+// parallel repeat buffers what this one buffers, and a trace recording still sees them.
+// each iteration runs the body's statements in a record of its own, which takes the place of the record
+// the body compound would make, so that the calls of the body find their functions as in a plain repeat
+struct parallel_repeat_statement : public repeat_statement
+{
+    struct buffered_call
+    {
+        const installed_function* p_function;
+        vector<shared_ptr<value>> args;
+    };
+
+    struct iteration
+    {
+        vector<buffered_call> calls;
+        // every iteration reports its errors on its own, the first one in iteration order wins
+        script_result error;
+        exception_ptr exception;
+    };
+
+    // a worker's native table, with the natives that are not thread safe replaced by buffering ones,
+    // and the same for the host functions of inner records, made as they are called
+    struct worker_frame
+    {
+        vector<installed_function> buffering;
+        vector<const installed_function*> natives;
+        unordered_map<const installed_function*, installed_function> buffering_host_functions;
+        host_function_redirect redirect;
+        iteration* p_current = nullptr;
+    };
+
+    static installed_function buffering(const installed_function& f, worker_frame* p_frame)
+    {
+        auto buffered = f;
+        auto p_function = &f;
+        buffered.function = [p_frame, p_function](const activation_record&, const vector<shared_ptr<value>>& args)
+        {
+            p_frame->p_current->calls.push_back(buffered_call { p_function, args });
+        };
+        return buffered;
+    }
+
+    virtual void execute(activation_record& r)
+    {
+        auto p_body = dynamic_cast<compound_statement*>(p_statement.get());
+        if (p_body == nullptr)
+            return r.fail("impossible: the body of a parallel repeat is not a compound statement", this);
+
+        auto& pool = work_pool::shared();
+        auto& natives = r.get_natives();
+        vector<worker_frame> frames(pool.concurrency());
+        for (auto& frame : frames)
+        {
+            auto p_frame = &frame;
+            auto p_record = &r;
+            frame.buffering.resize(natives.size());
+            frame.natives.resize(natives.size());
+            for (size_t id = 0; id < natives.size(); id++)
+            {
+                if (natives[id]->attributes & na_thread_safe)
+                {
+                    frame.natives[id] = natives[id];
+                    continue;
+                }
+                frame.buffering[id] = buffering(*natives[id], p_frame);
+                frame.natives[id] = &frame.buffering[id];
+            }
+            // nested loops run on the thread of the enclosing iteration, so the enclosing redirect is called
+            // from that thread only
+            frame.redirect = [p_frame, p_record](const installed_function* p_function) -> const installed_function*
+            {
+                p_function = p_record->redirected(p_function);
+                if (p_function->attributes & na_thread_safe)
+                    return p_function;
+                auto& known = p_frame->buffering_host_functions;
+                auto pbuffering = known.find(p_function);
+                if (pbuffering == known.end())
+                    pbuffering = known.insert(make_pair(p_function, buffering(*p_function, p_frame))).first;
+                return &pbuffering->second;
+            };
+        }
+
+        vector<iteration> iterations(max(num_repeat, 0L));
+        pool.parallel_for(iterations.size(), [&](int worker, long i)
+        {
+            auto& frame = frames[worker];
+            frame.p_current = &iterations[i];
+            try
+            {
+                activation_record iteration_record(&r, &frame.natives, &iterations[i].error);
+                iteration_record.redirect_host_functions(&frame.redirect);
+                p_body->execute_in(iteration_record);
+            }
+            catch (...)
+            {
+                iterations[i].exception = current_exception();
+            }
+        });
+
+        for (auto& it : iterations)
+        {
+            for (auto& call : it.calls)
+            {
+                call.p_function->function(r, call.args);
+                if (r.failed())
+                    return r.set_fault_node(this);
+            }
+            if (it.exception)
+                rethrow_exception(it.exception);
+            // a lazily parsed def body called by the iteration was malformed
+            if (it.error.status == result_status::parse_error)
+                return r.fail(it.error);
+            if (!it.error.ok())
+                return r.fail(it.error.text, it.error.p_node);
+        }
     }
 };
 
 struct if_statement : public statement
 {
-    unique_ptr<expr> p_expression;
-    unique_ptr<statement> p_statement;
+    shared_ptr<expr> p_expression;
+    shared_ptr<statement> p_statement;
 	virtual void execute(activation_record& r)
 	{
-        auto& boolval = dynamic_pointer_cast<typed_value<bool>>(p_expression->evaluate(r));
+        auto condition = p_expression->evaluate(r);
+        if (!condition)
+            return r.set_fault_node(this);
+        auto boolval = dynamic_pointer_cast<typed_value<bool>>(condition);
         if (!boolval)
-            throw runtime_exception("type mismatch for if condition, must be bool");
+            return r.fail("type mismatch for if condition, must be bool", this);
 		if (boolval->value)
 			p_statement->execute(r);
 	}
@@ -115,6 +310,21 @@ struct def_statement : public statement
     string name;
     vector<string> argnames;
     shared_ptr<statement> p_statement;
+    // set by a lazy parse instead of p_statement: parses the body, which is done on the first call
+    function<statement*(script_result&)> parse_body;
+    once_flag body_parsed;
+    script_result body_error;
+
+    // nullptr if the body failed to parse, with the error reported to r
+    statement* body(const activation_record& r)
+    {
+        if (parse_body)
+            call_once(body_parsed, [this] { p_statement.reset(parse_body(body_error)); });
+        if (!p_statement)
+            r.fail(body_error);
+        return p_statement.get();
+    }
+
     virtual void execute(activation_record& lexical_record)
     {
         // we can catch lexical_record by reference, since it the current design a function never leaves its
@@ -125,20 +335,41 @@ struct def_statement : public statement
         {
             // the referenced outer variables belong to a lexical scope, not a dynamic scope
             // (arbitrary language design desision, but most of languages do it this way)
-            activation_record inner(&lexical_record);
+            activation_record inner(&lexical_record, execution_record);
             int argnum = args.size();
             if (argnum != argnames.size())
-                throw runtime_exception("impossible: number of arguments mismatch for function call");
+                return inner.fail("impossible: number of arguments mismatch for function call");
+            auto p_body = body(inner);
+            if (!p_body)
+                return;
             for (int i = 0; i < argnum; i++)
                 inner.install_var(args[i], argnames[i]);
-            p_statement->execute(inner);
+            p_body->execute(inner);
         };
-        lexical_record.install_function(func, argnames.size(), name);
+        lexical_record.install_script_function(func, argnames.size(), name);
     }
 };
 
 struct program : public compound_statement
 {
+    // executes without throwing: errors, also those reported by natives through activation_record::fail,
+    // end up in the result
+    script_result try_execute(activation_record& r)
+    {
+        script_result result;
+        // the program's own record, reporting into result
+        activation_record checked(&r, &result);
+        try
+        {
+            execute_in(checked);
+        }
+        catch (const runtime_exception& ex)
+        {
+            // thrown by a native not using activation_record::fail
+            checked.fail(ex.text);
+        }
+        return result;
+    }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,465 @@
+#include "stdafx.h"
+#include "optimizer.h"
+
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+
+namespace
+{
+    // one level of names, like the namescopes of the parser and the activation records at runtime:
+    // the program, every compound statement, and the parameters of every def
+    struct scope
+    {
+        const scope* p_outer;
+        // the number of levels outside this one, 0 for the program's
+        int depth;
+        // the def whose parameters this level holds
+        const def_statement* p_owner;
+        // the defs declared on this level so far
+        vector<const def_statement*> defs;
+
+        scope(const scope* outer, const def_statement* owner = nullptr) :
+            p_outer(outer), depth(outer != nullptr ? outer->depth + 1 : 0), p_owner(owner)
+        {
+        }
+
+        // the def a call by name resolves to, with the same rules as namescope::lookup_func;
+        // nullptr if the call goes to the host
+        const def_statement* lookup_func(const string& name, size_t nargs, int* p_hops) const
+        {
+            int hops = 0;
+            for (const scope* s = this; s != nullptr; s = s->p_outer, hops++)
+            {
+                // like in a namescope, the first declaration of a name on a level wins
+                auto pdef = find_if(s->defs.begin(), s->defs.end(), [&](const def_statement* d) { return d->name == name; });
+                if (pdef != s->defs.end() && (*pdef)->argnames.size() == nargs)
+                {
+                    *p_hops = hops;
+                    return *pdef;
+                }
+            }
+            return nullptr;
+        }
+
+        // the def a variable is a parameter of, nullptr for host variables
+        const def_statement* lookup_var(const string& name) const
+        {
+            for (const scope* s = this; s != nullptr; s = s->p_outer)
+                if (s->p_owner != nullptr &&
+                    find(s->p_owner->argnames.begin(), s->p_owner->argnames.end(), name) != s->p_owner->argnames.end())
+                    return s->p_owner;
+            return nullptr;
+        }
+    };
+
+    struct call_info
+    {
+        // nullptr for natives and for functions of the host's records
+        const def_statement* p_target;
+        int hops;
+        // the innermost def the call is in, nullptr for the program's own code
+        const def_statement* p_caller;
+    };
+
+    // resolves all names of a program
+    struct analysis
+    {
+        unordered_map<const function_call*, call_info> calls;
+        unordered_map<const var*, const def_statement*> vars;
+        // with the depth of the level declaring them
+        unordered_map<const def_statement*, int> defs;
+        bool has_unparsed_defs = false;
+
+        explicit analysis(program& p)
+        {
+            scope top(nullptr);
+            for (auto& p_statement : p.statements)
+                walk(p_statement.get(), top, nullptr);
+        }
+
+        void walk(statement* s, scope& sc, const def_statement* p_caller)
+        {
+            if (auto pcall = dynamic_cast<function_call*>(s))
+            {
+                call_info info = { nullptr, 0, p_caller };
+                if (pcall->binding.native_id < 0)
+                    info.p_target = sc.lookup_func(pcall->function_name, pcall->p_params->params.size(), &info.hops);
+                calls[pcall] = info;
+                for (auto& param : pcall->p_params->params)
+                    walk(param.get(), sc);
+            }
+            else if (auto pcompound = dynamic_cast<compound_statement*>(s))
+            {
+                scope inner(&sc);
+                for (auto& p_statement : pcompound->statements)
+                    walk(p_statement.get(), inner, p_caller);
+            }
+            else if (auto prepeat = dynamic_cast<repeat_statement*>(s))
+            {
+                walk(prepeat->p_statement.get(), sc, p_caller);
+            }
+            else if (auto pif = dynamic_cast<if_statement*>(s))
+            {
+                walk(pif->p_expression.get(), sc);
+                walk(pif->p_statement.get(), sc, p_caller);
+            }
+            else if (auto pdef = dynamic_cast<def_statement*>(s))
+            {
+                // declared before its body, so it can call itself
+                sc.defs.push_back(pdef);
+                defs[pdef] = sc.depth;
+                if (!pdef->p_statement)
+                {
+                    has_unparsed_defs = true;
+                    return;
+                }
+                scope params(&sc, pdef);
+                walk(pdef->p_statement.get(), params, pdef);
+            }
+        }
+
+        void walk(expr* e, scope& sc)
+        {
+            if (auto pvar = dynamic_cast<var*>(e))
+                vars[pvar] = sc.lookup_var(pvar->name);
+        }
+    };
+
+    int statement_count(const statement* s, bool& has_defs)
+    {
+        if (auto pcompound = dynamic_cast<const compound_statement*>(s))
+        {
+            int count = 0;
+            for (auto& p_statement : pcompound->statements)
+                count += statement_count(p_statement.get(), has_defs);
+            return count;
+        }
+        if (auto prepeat = dynamic_cast<const repeat_statement*>(s))
+            return 1 + statement_count(prepeat->p_statement.get(), has_defs);
+        if (auto pif = dynamic_cast<const if_statement*>(s))
+            return 1 + statement_count(pif->p_statement.get(), has_defs);
+        if (dynamic_cast<const def_statement*>(s))
+            has_defs = true;
+        return 1;
+    }
+
+    template<typename T>
+    expr* clone_const(const expr* e)
+    {
+        auto pconst = dynamic_cast<const const_expr<T>*>(e);
+        if (!pconst)
+            return nullptr;
+        auto r = new const_expr<T>(*pconst->pv);
+        r->pv = pconst->pv;
+        return r;
+    }
+
+    class inliner
+    {
+        analysis a;
+        const int max_inline_size;
+        unordered_map<const def_statement*, bool> inlinable;
+        // the levels the body being inlined moves outwards by, negative if it moves inwards
+        int hop_shift = 0;
+
+        bool reaches(const def_statement* from, const def_statement* to, unordered_set<const def_statement*>& visited)
+        {
+            for (auto& call : a.calls)
+            {
+                if (call.second.p_caller != from || call.second.p_target == nullptr)
+                    continue;
+                if (call.second.p_target == to)
+                    return true;
+                if (visited.insert(call.second.p_target).second && reaches(call.second.p_target, to, visited))
+                    return true;
+            }
+            return false;
+        }
+
+        bool is_inlinable(const def_statement* pdef)
+        {
+            auto known = inlinable.find(pdef);
+            if (known != inlinable.end())
+                return known->second;
+            bool result = false;
+            if (pdef->p_statement)
+            {
+                bool has_defs = false;
+                int size = statement_count(pdef->p_statement.get(), has_defs);
+                unordered_set<const def_statement*> visited;
+                result = !has_defs && size <= max_inline_size && !reaches(pdef, pdef, visited);
+            }
+            inlinable[pdef] = result;
+            return result;
+        }
+
+        // checks that a name of the def's body, unless it is one of the def's parameters, means the same at sc.
+        // statements inlined in this round are not analyzed yet, and never match
+        bool name_matches(const expr* e, const def_statement* pdef, const scope& sc)
+        {
+            auto pvar = dynamic_cast<const var*>(e);
+            if (!pvar)
+                return true;
+            auto pbinding = a.vars.find(pvar);
+            return pbinding != a.vars.end() && (pbinding->second == pdef || sc.lookup_var(pvar->name) == pbinding->second);
+        }
+
+        bool names_match(const statement* s, const def_statement* pdef, const scope& sc)
+        {
+            if (auto pcall = dynamic_cast<const function_call*>(s))
+            {
+                auto pinfo = a.calls.find(pcall);
+                if (pinfo == a.calls.end())
+                    return false;
+                int hops;
+                if (pcall->binding.native_id < 0 &&
+                    sc.lookup_func(pcall->function_name, pcall->p_params->params.size(), &hops) != pinfo->second.p_target)
+                    return false;
+                for (auto& param : pcall->p_params->params)
+                    if (!name_matches(param.get(), pdef, sc))
+                        return false;
+                return true;
+            }
+            if (auto pcompound = dynamic_cast<const compound_statement*>(s))
+            {
+                for (auto& p_statement : pcompound->statements)
+                    if (!names_match(p_statement.get(), pdef, sc))
+                        return false;
+                return true;
+            }
+            if (auto prepeat = dynamic_cast<const repeat_statement*>(s))
+                return names_match(prepeat->p_statement.get(), pdef, sc);
+            if (auto pif = dynamic_cast<const if_statement*>(s))
+                return name_matches(pif->p_expression.get(), pdef, sc) && names_match(pif->p_statement.get(), pdef, sc);
+            return false;
+        }
+
+        // copies an expression of the body of pdef, with the arguments of the call substituted for its parameters
+        expr* clone(const expr* e, const def_statement* pdef, const paramlist* pargs)
+        {
+            if (auto pvar = dynamic_cast<const var*>(e))
+            {
+                if (pdef != nullptr && a.vars.at(pvar) == pdef)
+                {
+                    auto index = find(pdef->argnames.begin(), pdef->argnames.end(), pvar->name) - pdef->argnames.begin();
+                    return clone(pargs->params[index].get(), nullptr, nullptr);
+                }
+                return new var(pvar->name);
+            }
+            expr* r = clone_const<int>(e);
+            if (!r)
+                r = clone_const<chrono::seconds>(e);
+            if (!r)
+                r = clone_const<bool>(e);
+            return r;
+        }
+
+        statement* clone(const statement* s, const def_statement* pdef, const paramlist* pargs)
+        {
+            if (auto pcall = dynamic_cast<const function_call*>(s))
+            {
+                auto r = new function_call();
+                r->function_name = pcall->function_name;
+                r->binding = pcall->binding;
+                // a call to a function of the host's records counts its hops from where it is
+                if (r->binding.native_id < 0 && a.calls.at(pcall).p_target == nullptr)
+                    r->binding.scope_hops += hop_shift;
+                r->p_params.reset(new paramlist());
+                for (auto& param : pcall->p_params->params)
+                    r->p_params->params.emplace_back(clone(param.get(), pdef, pargs));
+                return r;
+            }
+            if (auto pcompound = dynamic_cast<const compound_statement*>(s))
+            {
+                auto r = new compound_statement();
+                for (auto& p_statement : pcompound->statements)
+                    r->statements.emplace_back(clone(p_statement.get(), pdef, pargs));
+                return r;
+            }
+            if (auto prepeat = dynamic_cast<const repeat_statement*>(s))
+            {
+                auto r = dynamic_cast<const parallel_repeat_statement*>(s) ? new parallel_repeat_statement() : new repeat_statement();
+                r->num_repeat = prepeat->num_repeat;
+                r->p_statement.reset(clone(prepeat->p_statement.get(), pdef, pargs));
+                return r;
+            }
+            if (auto pif = dynamic_cast<const if_statement*>(s))
+            {
+                auto r = new if_statement();
+                r->p_expression.reset(clone(pif->p_expression.get(), pdef, pargs));
+                r->p_statement.reset(clone(pif->p_statement.get(), pdef, pargs));
+                return r;
+            }
+            return nullptr;
+        }
+
+        // replaces the call at list[i] by the body of the called def; returns the number of statements put in
+        size_t try_inline(vector<shared_ptr<statement>>& list, size_t i, const scope& sc)
+        {
+            auto pcall = static_cast<const function_call*>(list[i].get());
+            auto pdef = a.calls[pcall].p_target;
+            if (pdef == nullptr || !is_inlinable(pdef))
+                return 0;
+            // the body's own level has no defs, so its statements can go directly into the caller's list
+            auto pbody = dynamic_cast<const compound_statement*>(pdef->p_statement.get());
+            if (!pbody || !names_match(pbody, pdef, sc))
+                return 0;
+
+            // the body's statements were two levels inside the def's, below its parameters
+            hop_shift = sc.depth - (a.defs.at(pdef) + 2);
+            vector<shared_ptr<statement>> inlined;
+            for (auto& p_statement : pbody->statements)
+                inlined.emplace_back(clone(p_statement.get(), pdef, pcall->p_params.get()));
+            list.erase(list.begin() + i);
+            list.insert(list.begin() + i, make_move_iterator(inlined.begin()), make_move_iterator(inlined.end()));
+            // the caller goes on after the inlined statements; after an empty body, with the statement
+            // that followed the call
+            return inlined.size();
+        }
+
+        void walk_list(vector<shared_ptr<statement>>& list, scope& sc)
+        {
+            size_t i = 0;
+            while (i < list.size())
+            {
+                auto s = list[i].get();
+                if (dynamic_cast<function_call*>(s) && a.calls.count(static_cast<function_call*>(s)))
+                {
+                    size_t size_before = list.size();
+                    size_t inserted = try_inline(list, i, sc);
+                    if (list.size() != size_before || inserted > 0)
+                    {
+                        // the inlined statements are new to the analysis, they are looked at in the next round
+                        changed = true;
+                        i += inserted;
+                        continue;
+                    }
+                }
+                walk(s, sc);
+                i++;
+            }
+        }
+
+        void walk(statement* s, scope& sc)
+        {
+            if (auto pcompound = dynamic_cast<compound_statement*>(s))
+            {
+                scope inner(&sc);
+                walk_list(pcompound->statements, inner);
+            }
+            else if (auto prepeat = dynamic_cast<repeat_statement*>(s))
+            {
+                walk(prepeat->p_statement.get(), sc);
+            }
+            else if (auto pif = dynamic_cast<if_statement*>(s))
+            {
+                walk(pif->p_statement.get(), sc);
+            }
+            else if (auto pdef = dynamic_cast<def_statement*>(s))
+            {
+                sc.defs.push_back(pdef);
+                if (pdef->p_statement)
+                {
+                    scope params(&sc, pdef);
+                    walk(pdef->p_statement.get(), params);
+                }
+            }
+        }
+
+    public:
+        bool changed = false;
+
+        inliner(program& p, int max_inline_size) : a(p), max_inline_size(max_inline_size)
+        {
+            scope top(nullptr);
+            walk_list(p.statements, top);
+        }
+    };
+
+    void remove_defs(vector<shared_ptr<statement>>& list, const unordered_set<const def_statement*>& live)
+    {
+        list.erase(remove_if(list.begin(), list.end(), [&](const shared_ptr<statement>& s)
+        {
+            auto pdef = dynamic_cast<const def_statement*>(s.get());
+            return pdef != nullptr && live.count(pdef) == 0;
+        }), list.end());
+
+        for (auto& p_statement : list)
+        {
+            statement* s = p_statement.get();
+            if (auto pdef = dynamic_cast<def_statement*>(s))
+                s = pdef->p_statement.get();
+            else if (auto prepeat = dynamic_cast<repeat_statement*>(s))
+                s = prepeat->p_statement.get();
+            else if (auto pif = dynamic_cast<if_statement*>(s))
+                s = pif->p_statement.get();
+            if (auto pcompound = dynamic_cast<compound_statement*>(s))
+                remove_defs(pcompound->statements, live);
+        }
+    }
+
+    // removes the defs not reachable through calls from the program's own code, or from its top-level defs
+    // if those are kept
+    void remove_dead_defs(program& p, bool keep_top_level_defs)
+    {
+        analysis a(p);
+        if (a.has_unparsed_defs)
+            return;
+
+        unordered_set<const def_statement*> live;
+        vector<const def_statement*> pending;
+        auto mark_callees = [&](const def_statement* p_caller)
+        {
+            for (auto& call : a.calls)
+                if (call.second.p_caller == p_caller && call.second.p_target != nullptr &&
+                    live.insert(call.second.p_target).second)
+                    pending.push_back(call.second.p_target);
+        };
+        mark_callees(nullptr);
+        if (keep_top_level_defs)
+        {
+            for (auto& p_statement : p.statements)
+            {
+                auto pdef = dynamic_cast<const def_statement*>(p_statement.get());
+                if (pdef != nullptr && live.insert(pdef).second)
+                    pending.push_back(pdef);
+            }
+        }
+        while (!pending.empty())
+        {
+            auto pdef = pending.back();
+            pending.pop_back();
+            mark_callees(pdef);
+        }
+
+        remove_defs(p.statements, live);
+    }
+}
+
+void optimize(program& p, int max_inline_size, bool keep_top_level_defs)
+{
+    // inlining a wrapper exposes the calls of its body, which can be inlined in turn
+    const int max_rounds = 16;
+    for (int round = 0; round < max_rounds; round++)
+    {
+        inliner pass(p, max_inline_size);
+        if (!pass.changed)
+            break;
+    }
+
+    remove_dead_defs(p, keep_top_level_defs);
+
+    // the statements moved, so the calls to script functions are bound anew. the calls to the host's
+    // functions were moved along when inlined
+    analysis a(p);
+    for (auto& call : a.calls)
+    {
+        auto pcall = const_cast<function_call*>(call.first);
+        if (call.second.p_target != nullptr)
+        {
+            pcall->binding.scope_hops = call.second.hops;
+            pcall->cached_serial.store(0);
+        }
+    }
+}
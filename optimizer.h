@@ -0,0 +1,22 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "nodes.h"
+
+/*
+optimization pass over a parsed program, to be run before the program is executed:
+  - calls to small non-recursive defs are replaced by the def's body, with the arguments
+    substituted for the parameters. a call is only inlined if every other name the body uses
+    means the same at the call site as at the def, so no lexical rebinding can change its meaning
+  - defs that are no longer called from anywhere are removed
+a def qualifies for inlining if its body has at most max_inline_size statements and declares
+no defs itself. defs of a lazy parse whose bodies are not parsed yet are left alone, and
+dead-def elimination is skipped for programs containing them, since their calls are unknown.
+the top-level defs of a prelude, e.g. of a snapshot, are called by scripts the optimizer does not see:
+pass keep_top_level_defs for it to keep them, along with the defs they call.
+run it before share_identical_subtrees, while every node still has a single place in the tree
+*/
+
+void optimize(program& p, int max_inline_size = 8, bool keep_top_level_defs = false);
+
+#endif
\ No newline at end of file
@@ -1,12 +1,13 @@
 #include "stdafx.h"
 #include "parser.h"
+#include "work_pool.h"
 
 /*
 grammar:
     program ::= statement* EOF
     compound-statement ::= '{' statement* '}'
     statement ::= repeat-statement | function-call | compound-statement | if-statement | def-statement
-    repeat-statement ::= "repeat" "(" expr ")" compound-statement
+    repeat-statement ::= ["parallel"] "repeat" "(" expr ")" compound-statement
     if-statement ::= "if" "(" expr ")" compound-statement
     def-statement ::= "def" ident "(" namelist ")" compound-statement
     function-call ::= ident "(" paramlist ")"
@@ -15,22 +16,106 @@ grammar:
     param ::= expr
 */
 
-// program ::= statement* EOF
 program* parser::parse(const namescope& initialns)
 {
-    unique_ptr<namescope> pns(initialns.clone());
+    return parse_program(initialns);
+}
+
+program* parser::try_parse(const namescope& initialns, script_result& result)
+{
+    p_error = &result;
+    program* p = parse_program(initialns);
+    p_error = nullptr;
+    return p;
+}
+
+vector<unique_ptr<program>> parse_batch(const vector<string>& sources, const namescope& ns,
+                                        vector<script_result>& results, bool parallel)
+{
+    vector<unique_ptr<program>> programs(sources.size());
+    results.assign(sources.size(), script_result());
+    auto& pool = work_pool::shared();
+    vector<unique_ptr<parser>> parsers(parallel ? pool.concurrency() : 1);
+    auto parse_one = [&](int worker, long i)
+    {
+        auto& p = parsers[worker];
+        if (p)
+            p->reset(sources[i]);
+        else
+            p.reset(new parser(sources[i]));
+        programs[i].reset(p->try_parse(ns, results[i]));
+    };
+    if (parallel)
+    {
+        pool.parallel_for(sources.size(), parse_one);
+    }
+    else
+    {
+        for (size_t i = 0; i < sources.size(); i++)
+            parse_one(0, i);
+    }
+    return programs;
+}
+
+statement* parser::parse_next(const namescope& initialns)
+{
+    if (!p_program_scope)
+        p_program_scope.reset(new namescope(&initialns));
+    statement* s = try_parse_statement(p_program_scope.get());
+    if (s || failed())
+        return s;
+    token t = tokenizer.peek_next();
+    if (t.type != tt_eof)
+        return fail("extra characters after program end", t);
+    return nullptr;
+}
+
+statement* parser::try_parse_next(const namescope& initialns, script_result& result)
+{
+    p_error = &result;
+    statement* s = parse_next(initialns);
+    p_error = nullptr;
+    return s;
+}
+
+// reports a parse error. throws, unless parsing with try_parse: then the first error is kept,
+// and the nullptr returned makes every caller up the chain give up
+nullptr_t parser::fail(const string& text, const token& t)
+{
+    if (p_error == nullptr)
+        throw parse_exception(text, t);
+    if (p_error->ok())
+    {
+        p_error->status = result_status::parse_error;
+        p_error->text = text;
+        p_error->row = t.lineno;
+        p_error->col = t.colno;
+    }
+    return nullptr;
+}
+
+// program ::= statement* EOF
+program* parser::parse_program(const namescope& initialns)
+{
+    // the script's own level over the host scope, so that its defs can shadow the host functions.
+    // shared with the deferred bodies of lazily parsed defs, which look up names in it on their first call.
+    // the host scope is referenced, not copied: it can hold thousands of natives
+    p_program_scope.reset(new namescope(&initialns));
+    namescope* pns = p_program_scope.get();
     unique_ptr<program> p(new program());
     while (true)
     {
-        statement* s = try_parse_statement(pns.get());
+        statement* s = try_parse_statement(pns);
         if (!s)
             break;
         p->statements.emplace_back(s);
     }
+    if (failed())
+        return nullptr;
 
     token t = tokenizer.peek_next();
     if (t.type != tt_eof)
-        throw parse_exception("extra characters after program end", t);
+        return fail("extra characters after program end", t);
     return p.release();
 }
 
@@ -50,9 +135,11 @@ compound_statement* parser::try_parse_compound_statement(namescope* pns)
             break;
         p->statements.emplace_back(s);
     }
+    if (failed())
+        return nullptr;
     t = tokenizer.peek_next();
     if (t.type != tt_rbrace)
-        throw parse_exception("expected closing brace after compound statement", t);
+        return fail("expected closing brace after compound statement", t);
     tokenizer.move_ahead();
     return p.release();
 }
@@ -60,60 +147,69 @@ compound_statement* parser::try_parse_compound_statement(namescope* pns)
 // statement ::= repeat-statement | function-call | compound-statement | if-statement | def-statement
 statement* parser::try_parse_statement(namescope* pns)
 {
+    token start = tokenizer.peek_next();
     statement* result = nullptr;
     result = try_parse_repeat_statement(pns);
-    if (result)
-        return result;
+    if (result || failed())
+        return located(result, start);
 
     result = try_parse_function_call(pns);
-    if (result)
-        return result;
+    if (result || failed())
+        return located(result, start);
 
     result = try_parse_compound_statement(pns);
-    if (result)
-        return result;
+    if (result || failed())
+        return located(result, start);
 
     result = try_parse_if_statement(pns);
-    if (result)
-        return result;
+    if (result || failed())
+        return located(result, start);
 
     result = try_parse_def_statement(pns);
-    if (result)
-        return result;
+    if (result || failed())
+        return located(result, start);
 
     return nullptr;
 }
 
-// repeat-statement ::= "repeat" "(" number-constant ")" compound-statement
+// repeat-statement ::= ["parallel"] "repeat" "(" number-constant ")" compound-statement
 repeat_statement* parser::try_parse_repeat_statement(namescope* pns)
 {
     token t = tokenizer.peek_next();
+    bool parallel = t.type == tt_parallel;
+    if (parallel)
+    {
+        tokenizer.move_ahead();
+        t = tokenizer.peek_next();
+        if (t.type != tt_repeat)
+            return fail("repeat expected after parallel", t);
+    }
     if (t.type != tt_repeat)
         return nullptr;
     tokenizer.move_ahead();
 
     t = tokenizer.peek_next();
     if (t.type != tt_lparen)
-        throw parse_exception("opening parenthesis expected", t);
+        return fail("opening parenthesis expected", t);
     tokenizer.move_ahead();
 
     t = tokenizer.peek_next();
     if (t.type != tt_number)
-        throw parse_exception("number expected", t);
+        return fail("number expected", t);
     tokenizer.move_ahead();
 
     long num = t.num_value;
 
     t = tokenizer.peek_next();
     if (t.type != tt_rparen)
-        throw parse_exception("closing parenthesis expected", t);
+        return fail("closing parenthesis expected", t);
     tokenizer.move_ahead();
 
     unique_ptr<compound_statement> s(try_parse_compound_statement(pns));
     if (!s)
-        throw parse_exception("compound statement expected after repeat", tokenizer.peek_next());
+        return fail("compound statement expected after repeat", tokenizer.peek_next());
 
-    repeat_statement* rs = new repeat_statement();
+    repeat_statement* rs = parallel ? new parallel_repeat_statement() : new repeat_statement();
     rs->num_repeat = num;
     rs->p_statement = move(s);
     return rs;
@@ -129,21 +225,21 @@ if_statement* parser::try_parse_if_statement(namescope* pns)
 
     t = tokenizer.peek_next();
     if (t.type != tt_lparen)
-        throw parse_exception("opening parenthesis expected", t);
+        return fail("opening parenthesis expected", t);
     tokenizer.move_ahead();
 
     unique_ptr<expr> condition(try_parse_expr(pns));
     if (!condition)
-        throw parse_exception("expression expected", tokenizer.peek_next());
+        return fail("expression expected", tokenizer.peek_next());
 
     t = tokenizer.peek_next();
     if (t.type != tt_rparen)
-        throw parse_exception("closing parenthesis expected", t);
+        return fail("closing parenthesis expected", t);
     tokenizer.move_ahead();
 
     unique_ptr<compound_statement> s(try_parse_compound_statement(pns));
     if (!s)
-        throw parse_exception("compound statement expected after repeat", tokenizer.peek_next());
+        return fail("compound statement expected after repeat", tokenizer.peek_next());
 
     if_statement* is = new if_statement();
     is->p_expression = move(condition);
@@ -162,33 +258,36 @@ def_statement* parser::try_parse_def_statement(namescope* pns)
 
     t = tokenizer.peek_next();
     if (t.type != tt_ident)
-        throw parse_exception("identifier for function name expected", t);
+        return fail("identifier for function name expected", t);
     tokenizer.move_ahead();
 
     string name = t.string_value;
 
     t = tokenizer.peek_next();
     if (t.type != tt_lparen)
-        throw parse_exception("opening parenthesis expected", t);
+        return fail("opening parenthesis expected", t);
     tokenizer.move_ahead();
 
     unique_ptr<namelist> args(try_parse_namelist_until_rparen(pns));
     if (!args)
-        throw parse_exception("expected argument list for function definition", tokenizer.peek_next());
+        return fail("expected argument list for function definition", tokenizer.peek_next());
 
     t = tokenizer.peek_next();
     if (t.type != tt_rparen)
-        throw parse_exception("closing parenthesis expected", t);
+        return fail("closing parenthesis expected", t);
     tokenizer.move_ahead();
 
     pns->install_function(name, args->names.size());
+    if (lazy_defs)
+        return defer_def_body(pns, name, args->names);
+
     namescope inner(pns);
     for (auto& argname : args->names)
         inner.install_var(argname);
 
     unique_ptr<compound_statement> s(try_parse_compound_statement(&inner));
     if (!s)
-        throw parse_exception("compound statement expected for function body", tokenizer.peek_next());
+        return fail("compound statement expected for function body", tokenizer.peek_next());
 
     def_statement* ds = new def_statement();
     ds->name = name;
@@ -197,6 +296,65 @@ def_statement* parser::try_parse_def_statement(namescope* pns)
     return ds;
 }
 
+// the scope a deferred def body is parsed in. the enclosing scopes die with the initial parse, so the body
+// gets a copy of them, seeing just the names declared before the def. the program scope only grows, so it is
+// shared instead, and limited to its size at the point of the def
+struct deferred_scope
+{
+    shared_ptr<namescope> p_program_scope;
+    unique_ptr<namescope> p_copy;
+    const namescope* pns;
+    int limit;
+};
+
+// lazy mode: brace-matches the body of a def, leaving its parsing until the first call
+def_statement* parser::defer_def_body(namescope* pns, string name, const vector<string>& argnames)
+{
+    token body_start = tokenizer.peek_next();
+    if (body_start.type != tt_lbrace)
+        return fail("compound statement expected for function body", body_start);
+    if (!tokenizer.skip_braced_block())
+        return fail("expected closing brace after compound statement", tokenizer.peek_next());
+
+    auto pscope = make_shared<deferred_scope>();
+    pscope->p_program_scope = p_program_scope;
+    if (pns == p_program_scope.get())
+    {
+        pscope->pns = pns;
+        pscope->limit = pns->declaration_count();
+    }
+    else
+    {
+        pscope->p_copy.reset(pns->copy_until(p_program_scope.get()));
+        pscope->pns = pscope->p_copy.get();
+        pscope->limit = numeric_limits<int>::max();
+    }
+
+    auto text = tokenizer.get_text();
+    def_statement* ds = new def_statement();
+    ds->name = name;
+    ds->argnames = argnames;
+    ds->parse_body = [text, body_start, pscope, argnames](script_result& error)
+    {
+        return parse_deferred_body(text, body_start, pscope->pns, pscope->limit, argnames, error);
+    };
+    return ds;
+}
+
+// parses the body of a lazily parsed def, starting at its opening brace. errors are reported into `error`,
+// at their original position in the text
+statement* parser::parse_deferred_body(shared_ptr<const string> text, token body_start,
+                                       const namescope* pns, int limit, const vector<string>& argnames,
+                                       script_result& error)
+{
+    parser p(text, body_start);
+    p.p_error = &error;
+    namescope inner(pns, limit);
+    for (auto& argname : argnames)
+        inner.install_var(argname);
+    return p.try_parse_compound_statement(&inner);
+}
+
 // function-call ::= ident "(" arglist ")"
 function_call* parser::try_parse_function_call(namescope* pns)
 {
@@ -209,27 +367,29 @@ function_call* parser::try_parse_function_call(namescope* pns)
 
     token t = tokenizer.peek_next();
     if (t.type != tt_lparen)
-        throw parse_exception("left parenthesis expected for function call", t);
+        return fail("left parenthesis expected for function call", t);
     tokenizer.move_ahead();
 
     unique_ptr<paramlist> args(try_parse_paramlist_until_rparen(pns));
     if (!args)
-        throw parse_exception("argument list not found", tokenizer.peek_next());
+        return fail("argument list not found", tokenizer.peek_next());
 
     t = tokenizer.peek_next();
     if (t.type != tt_rparen)
-        throw parse_exception("right parenthesis expected after function call arg list", t);
+        return fail("right parenthesis expected after function call arg list", t);
     tokenizer.move_ahead();
 
-    auto lookup = pns->lookup_func(name, args->params.size());
+    function_binding binding;
+    auto lookup = pns->lookup_func(name, args->params.size(), &binding);
     if (lookup == namescope::lookup_result::not_found)
-        throw parse_exception("unknown function", ft);
+        return fail("unknown function", ft);
     if (lookup == namescope::lookup_result::wrong_signature)
-        throw parse_exception("signature mismatch for function", ft);
+        return fail("signature mismatch for function", ft);
 
     function_call* fc = new function_call();
     fc->function_name = name;
     fc->p_params = move(args);
+    fc->binding = binding;
     return fc;
 }
 
@@ -253,12 +413,12 @@ expr* parser::try_parse_expr(namescope* pns)
     else if (t.type == tt_ident)
     {
         if (pns->lookup_var(t.string_value) != namescope::lookup_result::found)
-            throw parse_exception("unknown variable", t);
+            return fail("unknown variable", t);
         result = new var(t.string_value);
     }
     if (result != nullptr)
         tokenizer.move_ahead();
-    return result;
+    return located(result, t);
 }
 
 // param ::= expr
@@ -279,14 +439,14 @@ paramlist* parser::try_parse_paramlist_until_rparen(namescope* pns)
     {
         expr* p = try_parse_param(pns);
         if (!p)
-            throw parse_exception("expected argument", tokenizer.peek_next());
+            return fail("expected argument", tokenizer.peek_next());
         result->params.emplace_back(p);
 
         t = tokenizer.peek_next();
         if (t.type == tt_rparen)
             return result.release();
         if (t.type != tt_comma)
-            throw parse_exception("comma expected between arguments", t);
+            return fail("comma expected between arguments", t);
         tokenizer.move_ahead();
     }
 }
@@ -302,7 +462,7 @@ namelist* parser::try_parse_namelist_until_rparen(namescope* pns)
     while (true)
     {
         if (t.type != tt_ident)
-            throw parse_exception("expected identifier for argument name", t);
+            return fail("expected identifier for argument name", t);
         result->names.emplace_back(t.string_value);
         tokenizer.move_ahead();
 
@@ -310,7 +470,7 @@ namelist* parser::try_parse_namelist_until_rparen(namescope* pns)
         if (t.type == tt_rparen)
             return result.release();
         if (t.type != tt_comma)
-            throw parse_exception("comma expected between argument names", t);
+            return fail("comma expected between argument names", t);
 
         tokenizer.move_ahead();
         t = tokenizer.peek_next();
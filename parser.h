@@ -3,12 +3,14 @@
 
 #include <string>
 #include <memory>
+#include <cstddef>
 #include <unordered_map>
 
 #include "tokenizer.h"
 #include "nodes.h"
 #include "installed_functions.h"
 #include "exc.h"
+#include "source_map.h"
 
 using namespace std;
 
@@ -17,7 +19,7 @@ grammar:
     program ::= statement* EOF
     compound-statement ::= '{' statement* '}'
     statement ::= repeat-statement | function-call | compound-statement | if-statement | def-statement
-    repeat-statement ::= "repeat" "(" expr ")" compound-statement
+    repeat-statement ::= ["parallel"] "repeat" "(" expr ")" compound-statement
 	if-statement ::= "if" "(" expr ")" compound-statement
     def-statement ::= "def" ident "(" namelist ")" compound-statement
     function-call ::= ident "(" paramlist ")"
@@ -39,16 +41,83 @@ class parser
     compound_statement* try_parse_compound_statement(namescope* pns);
     if_statement* try_parse_if_statement(namescope* pns);
     def_statement* try_parse_def_statement(namescope* pns);
+    def_statement* defer_def_body(namescope* pns, string name, const vector<string>& argnames);
+
+    static statement* parse_deferred_body(shared_ptr<const string> text, token body_start,
+                                          const namescope* pns, int limit, const vector<string>& argnames,
+                                          script_result& error);
+
+    program* parse_program(const namescope& initialns);
+
+    // where errors go when parsing without exceptions
+    script_result* p_error;
+    // where the positions of the nodes go, if anywhere
+    source_map* p_source_map = nullptr;
+
+    template<typename T>
+    T* located(T* node, const token& t)
+    {
+        if (node != nullptr && p_source_map != nullptr)
+            p_source_map->add(node, source_position { t.lineno, t.colno });
+        return node;
+    }
+
+    nullptr_t fail(const string& text, const token& t);
+    bool failed() const { return p_error != nullptr && !p_error->ok(); }
 
     tokenizer tokenizer;
+    // lazy mode: def bodies are only brace-matched, and parsed on the first call of the function
+    const bool lazy_defs;
+    shared_ptr<namescope> p_program_scope;
+
+    parser(shared_ptr<const string> text, const token& start) :
+        p_error(nullptr), tokenizer(text, start.offset, start.lineno, start.colno), lazy_defs(false)
+    {
+    }
 
 public:
+    // initialns is referenced by the parse, and in lazy mode also by the program's unparsed def bodies,
+    // so it must outlive their first calls, and must not get new functions the script could see meanwhile
     program* parse(const namescope& initialns);
+    // parses without throwing: on error returns nullptr, with the error in result
+    program* try_parse(const namescope& initialns, script_result& result);
+
+    // streaming: parses the next top-level statement of the program, reading no more input than it needs.
+    // returns nullptr at the end of the program. the statements are to be executed in order, all in one
+    // record, which stands for the program's own top level
+    statement* parse_next(const namescope& initialns);
+    statement* try_parse_next(const namescope& initialns, script_result& result);
 
 public:
-    parser(string input) : tokenizer(input)
+    parser(string input, bool lazy_defs = false) : p_error(nullptr), tokenizer(input), lazy_defs(lazy_defs)
     {
     }
+
+    // streaming: parses the program as it is read from input, with parse_next. lazy defs would need to keep
+    // the whole text, so they are not supported here
+    explicit parser(istream& input) : p_error(nullptr), tokenizer(input), lazy_defs(false)
+    {
+    }
+
+    // records the positions of the statements and expressions parsed from now on; bodies of lazily parsed
+    // defs are parsed later, and are not covered
+    void set_source_map(source_map* p_map)
+    {
+        p_source_map = p_map;
+    }
+
+    // starts over on a new input, keeping the buffers of the previous parse
+    void reset(const string& input)
+    {
+        tokenizer.reset(input);
+        p_program_scope.reset();
+    }
 };
 
+// parses every source against ns, each worker with a parser of its own that it resets from source to source.
+// with parallel set, the sources are spread over the shared work pool. programs[i] is nullptr if sources[i]
+// failed to parse, with the error in results[i]
+vector<unique_ptr<program>> parse_batch(const vector<string>& sources, const namescope& ns,
+                                        vector<script_result>& results, bool parallel = false);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,82 @@
+#include "stdafx.h"
+#include "program_registry.h"
+
+#include <algorithm>
+#include <limits>
+
+program_registry::program_registry(int max_readers) :
+    slots(new reader_slot[max_readers]), nslots(max_readers)
+{
+}
+
+program_registry::~program_registry()
+{
+    delete current.load();
+    for (auto p_version : retired)
+        delete p_version;
+}
+
+program_registry::reader::reader(program_registry& registry) : registry(registry), p_slot(nullptr)
+{
+    for (int i = 0; i < registry.nslots && p_slot == nullptr; i++)
+    {
+        bool expected = false;
+        if (registry.slots[i].claimed.compare_exchange_strong(expected, true, memory_order_acquire))
+            p_slot = &registry.slots[i];
+    }
+    if (p_slot == nullptr)
+        throw runtime_exception("no free reader slot in the program registry");
+}
+
+program_registry::pinned program_registry::reader::pin()
+{
+    // the epoch is published before the version is read: a publisher that doesn't see it yet has
+    // swapped the version before, so the one read here is not the retired one. all seq_cst, since
+    // the store and the load must not be reordered
+    p_slot->epoch.store(registry.global_epoch.load());
+    return pinned(p_slot, registry.current.load());
+}
+
+unsigned long program_registry::publish(unique_ptr<program> tree)
+{
+    lock_guard<mutex> lock(retire_mutex);
+    auto p_version = new version { move(tree), ++last_number, 0 };
+    auto p_old = current.exchange(p_version);
+    // readers pinning at a later epoch read the new version
+    auto epoch = global_epoch.fetch_add(1);
+    if (p_old != nullptr)
+    {
+        p_old->retired_at = epoch;
+        retired.push_back(p_old);
+    }
+    collect_locked();
+    return p_version->number;
+}
+
+void program_registry::collect()
+{
+    lock_guard<mutex> lock(retire_mutex);
+    collect_locked();
+}
+
+size_t program_registry::retired_count()
+{
+    lock_guard<mutex> lock(retire_mutex);
+    return retired.size();
+}
+
+void program_registry::collect_locked()
+{
+    auto oldest_pin = numeric_limits<unsigned long long>::max();
+    for (int i = 0; i < nslots; i++)
+    {
+        auto epoch = slots[i].epoch.load();
+        if (epoch != 0)
+            oldest_pin = min(oldest_pin, epoch);
+    }
+    auto freed = stable_partition(retired.begin(), retired.end(),
+                                  [oldest_pin](const version* p_version) { return p_version->retired_at >= oldest_pin; });
+    for (auto it = freed; it != retired.end(); ++it)
+        delete *it;
+    retired.erase(freed, retired.end());
+}
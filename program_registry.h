@@ -0,0 +1,126 @@
+#ifndef PROGRAM_REGISTRY_H
+#define PROGRAM_REGISTRY_H
+
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <mutex>
+
+#include "nodes.h"
+
+using namespace std;
+
+/*
+the current version of a program, replaceable while workers keep executing it. a worker pins the
+current version for the time of an execution; publishing a new version swaps a pointer, and the old
+tree, closures of its defs included, is freed only once no worker can still be executing it.
+reclamation is epoch based: a pin writes the global epoch into the worker's reader slot, and a
+version retired at epoch e is freed when every pinned slot shows a later epoch. pinning and
+unpinning take no locks; publish and collect serialize among themselves.
+the namescope the versions are parsed against must outlive the registry
+*/
+
+class program_registry
+{
+    struct version
+    {
+        unique_ptr<program> tree;
+        unsigned long number;
+        // the global epoch when the version was replaced
+        unsigned long long retired_at;
+    };
+
+    // one cache line each, so that workers pinning at once don't contend
+    struct reader_slot
+    {
+        // the epoch the reader pinned at, 0 when it is not pinned
+        atomic<unsigned long long> epoch{ 0 };
+        atomic<bool> claimed{ false };
+        char padding[64 - sizeof(atomic<unsigned long long>) - sizeof(atomic<bool>)];
+    };
+
+    unique_ptr<reader_slot[]> slots;
+    const int nslots;
+    atomic<unsigned long long> global_epoch{ 1 };
+    atomic<version*> current{ nullptr };
+
+    mutex retire_mutex;
+    vector<version*> retired;
+    unsigned long last_number = 0;
+
+    void collect_locked();
+
+public:
+    class reader;
+
+    // a version pinned by a reader: stays alive until the pin is destroyed
+    class pinned
+    {
+        reader_slot* p_slot;
+        version* p_version;
+
+        pinned(reader_slot* p_slot, version* p_version) : p_slot(p_slot), p_version(p_version) { }
+        friend class reader;
+
+    public:
+        pinned(pinned&& other) : p_slot(other.p_slot), p_version(other.p_version)
+        {
+            other.p_slot = nullptr;
+        }
+        pinned(const pinned&) = delete;
+        ~pinned()
+        {
+            if (p_slot != nullptr)
+                p_slot->epoch.store(0, memory_order_release);
+        }
+
+        // nullptr if no version was published yet
+        program* get() const
+        {
+            return p_version != nullptr ? p_version->tree.get() : nullptr;
+        }
+
+        // 1 for the first version published, 0 if none was
+        unsigned long number() const
+        {
+            return p_version != nullptr ? p_version->number : 0;
+        }
+    };
+
+    // a worker's reader slot, claimed for the reader's lifetime. a reader holds one pin at a time,
+    // and is used by one thread at a time
+    class reader
+    {
+        program_registry& registry;
+        reader_slot* p_slot;
+
+    public:
+        // throws runtime_exception if all the registry's slots are claimed
+        explicit reader(program_registry& registry);
+        reader(const reader&) = delete;
+        ~reader()
+        {
+            p_slot->claimed.store(false, memory_order_release);
+        }
+
+        pinned pin();
+    };
+
+    explicit program_registry(int max_readers = 64);
+    program_registry(const program_registry&) = delete;
+    // no reader may be left
+    ~program_registry();
+
+    // makes the program the current version, and frees the retired versions no longer pinned.
+    // returns the new version's number
+    unsigned long publish(unique_ptr<program> tree);
+
+    // frees the retired versions no longer pinned. publish does this too; an idle registry
+    // can be collected with this
+    void collect();
+
+    // the number of retired versions not freed yet
+    size_t retired_count();
+};
+
+#endif
\ No newline at end of file
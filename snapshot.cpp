@@ -0,0 +1,17 @@
+#include "stdafx.h"
+#include "snapshot.h"
+
+#include "parser.h"
+
+snapshot::snapshot(const activation_record& host, const string& prelude_text) : prelude_record(&host)
+{
+    parser p(prelude_text);
+    prelude.reset(p.parse(host.get_ns()));
+    // the prelude's top level is the snapshot's record itself, in place of the record program::execute would create
+    for (auto& p_statement : prelude->statements)
+    {
+        p_statement->execute(prelude_record);
+        if (auto pdef = dynamic_cast<def_statement*>(p_statement.get()))
+            prelude_record.declare_script_function(pdef->name, pdef->argnames.size());
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+#include <memory>
+
+#include "nodes.h"
+
+using namespace std;
+
+/*
+an interpreter state after a prelude of defs has run against the host. the prelude is executed once,
+directly in a record of the snapshot, so its closures stay alive with the snapshot instead of dying
+with the record program::execute would create for them.
+execution contexts forked from the snapshot are empty inner records of it: they share the function
+and variable tables of the snapshot and the host instead of copying them, and whatever a context
+installs goes into its own tables. forking is O(1), independent of the number of natives and defs.
+contexts can be forked and used on several threads at once, since they never write to the snapshot
+*/
+
+class snapshot
+{
+    activation_record prelude_record;
+    unique_ptr<program> prelude;
+
+public:
+    // parses and runs the prelude against host. throws parse_exception or runtime_exception
+    // if the prelude fails. the host must outlive the snapshot, and must not change while it lives
+    snapshot(const activation_record& host, const string& prelude_text);
+    snapshot(const snapshot&) = delete;
+
+    // a fresh execution context. scripts are parsed against its get_ns() and executed in it.
+    // must not outlive the snapshot
+    unique_ptr<activation_record> fork() const
+    {
+        return unique_ptr<activation_record>(new activation_record(&prelude_record));
+    }
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,48 @@
+#ifndef SOURCE_MAP_H
+#define SOURCE_MAP_H
+
+#include <vector>
+#include <unordered_map>
+
+using namespace std;
+
+struct source_position
+{
+    int row;
+    int col;
+};
+
+// where in the source the nodes of a program were parsed from, kept aside so that the nodes stay small
+// and can be shared. a node shared by share_identical_subtrees has the positions of all its occurrences;
+// the nodes faults are reported by are not shared when a map is given, and keep a single position
+class source_map
+{
+    unordered_map<const void*, vector<source_position>> positions;
+
+public:
+    void add(const void* node, source_position position)
+    {
+        positions[node].push_back(position);
+    }
+
+    // the positions of a node, nullptr if none are known
+    const vector<source_position>* find(const void* node) const
+    {
+        auto ppositions = positions.find(node);
+        return ppositions != positions.end() ? &ppositions->second : nullptr;
+    }
+
+    // the node `from` is replaced by `into`, which takes over its positions
+    void merge(const void* from, const void* into)
+    {
+        auto pfrom = positions.find(from);
+        if (pfrom == positions.end())
+            return;
+        auto moved = move(pfrom->second);
+        positions.erase(pfrom);
+        auto& target = positions[into];
+        target.insert(target.end(), moved.begin(), moved.end());
+    }
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,249 @@
+#include "stdafx.h"
+#include "spmd.h"
+
+#include <algorithm>
+#include <chrono>
+
+// mirrors an activation record, with a column instead of a value for each variable
+struct spmd_executor::scope
+{
+    const scope* p_outer;
+    unordered_map<string, shared_ptr<const column>> vars;
+    // the defs executed in this scope; like the records, the first def of a name wins
+    unordered_map<string, def_statement*> functions;
+
+    scope(const scope* outer) : p_outer(outer) { }
+
+    shared_ptr<const column> get_var(const string& name) const
+    {
+        auto pvar = vars.find(name);
+        if (pvar != vars.end())
+            return pvar->second;
+        return p_outer != nullptr ? p_outer->get_var(name) : nullptr;
+    }
+};
+
+namespace
+{
+    bool any_lane(const vector<char>& mask)
+    {
+        return any_of(mask.begin(), mask.end(), [](char active) { return active != 0; });
+    }
+
+    bool all_lanes(const vector<char>& mask)
+    {
+        return all_of(mask.begin(), mask.end(), [](char active) { return active != 0; });
+    }
+
+    shared_ptr<column> broadcast(const value& v, size_t lanes)
+    {
+        auto c = make_shared<column>();
+        long long x;
+        if (auto pint = dynamic_cast<const typed_value<int>*>(&v))
+        {
+            c->type = column_type::int_value;
+            x = pint->value;
+        }
+        else if (auto ptime = dynamic_cast<const typed_value<chrono::seconds>*>(&v))
+        {
+            c->type = column_type::seconds_value;
+            x = ptime->value.count();
+        }
+        else if (auto pbool = dynamic_cast<const typed_value<bool>*>(&v))
+        {
+            c->type = column_type::bool_value;
+            x = pbool->value;
+        }
+        else
+            throw runtime_exception("value of unknown type in lockstep execution");
+        c->values.assign(lanes, x);
+        return c;
+    }
+
+    shared_ptr<value> box(const column& c, size_t lane)
+    {
+        long long x = c.values[lane];
+        switch (c.type)
+        {
+        case column_type::int_value:
+            return make_shared<typed_value<int>>((int)x);
+        case column_type::seconds_value:
+            return make_shared<typed_value<chrono::seconds>>(chrono::seconds(x));
+        default:
+            return make_shared<typed_value<bool>>(x != 0);
+        }
+    }
+}
+
+spmd_executor::spmd_executor(const activation_record& host, size_t lanes) :
+    host(host), lanes(lanes), batched(host.get_natives().size())
+{
+}
+
+void spmd_executor::install_batched(const string& name, int argnum, batched_native f)
+{
+    function_binding binding;
+    if (host.get_ns().lookup_func(name, argnum, &binding) != namescope::lookup_result::found || binding.native_id < 0)
+        throw runtime_exception("no native " + name + " with " + to_string(argnum) + " arguments to batch");
+    batched[binding.native_id] = f;
+}
+
+void spmd_executor::run(const program& p, const string& entry, const vector<column>& args)
+{
+    for (auto& arg : args)
+        if (arg.values.size() != lanes)
+            throw runtime_exception("argument column size differs from the number of lanes");
+
+    vector<char> mask(lanes, 1);
+    scope top(nullptr);
+    for (auto& p_statement : p.statements)
+        execute(p_statement.get(), top, mask);
+
+    auto pdef = top.functions.find(entry);
+    if (pdef == top.functions.end() || pdef->second->argnames.size() != args.size())
+        throw runtime_exception("no def " + entry + " with " + to_string(args.size()) + " arguments at the top level");
+    auto p_def = pdef->second;
+    auto p_body = p_def->body(host);
+    if (!p_body)
+        return;
+    scope params(&top);
+    for (size_t i = 0; i < args.size(); i++)
+        params.vars.insert(make_pair(p_def->argnames[i], make_shared<const column>(args[i])));
+    execute(p_body, params, mask);
+}
+
+shared_ptr<const column> spmd_executor::evaluate(const expr* e, const scope& sc)
+{
+    if (auto pvar = dynamic_cast<const var*>(e))
+    {
+        auto c = sc.get_var(pvar->name);
+        if (c)
+            return c;
+    }
+    // constants, and the host's variables, which don't change during the run
+    auto pconst = constants.find(e);
+    if (pconst != constants.end())
+        return pconst->second;
+
+    shared_ptr<value> v;
+    if (auto pvar = dynamic_cast<const var*>(e))
+        v = host.get_var(pvar->name);
+    else if (auto pint = dynamic_cast<const const_expr<int>*>(e))
+        v = pint->pv;
+    else if (auto ptime = dynamic_cast<const const_expr<chrono::seconds>*>(e))
+        v = ptime->pv;
+    else if (auto pbool = dynamic_cast<const const_expr<bool>*>(e))
+        v = pbool->pv;
+    if (!v)
+        throw runtime_exception("impossible: cannot evaluate expression in lockstep execution");
+    shared_ptr<const column> c = broadcast(*v, lanes);
+    constants.insert(make_pair(e, c));
+    return c;
+}
+
+void spmd_executor::execute(statement* s, scope& sc, const vector<char>& mask)
+{
+    if (auto pcall = dynamic_cast<const function_call*>(s))
+        return call(pcall, sc, mask);
+
+    if (auto pcompound = dynamic_cast<const compound_statement*>(s))
+    {
+        scope inner(&sc);
+        for (auto& p_statement : pcompound->statements)
+            execute(p_statement.get(), inner, mask);
+        return;
+    }
+
+    // a parallel repeat too: its output comes out as from a plain repeat anyway
+    if (auto prepeat = dynamic_cast<const repeat_statement*>(s))
+    {
+        for (long i = 0; i < prepeat->num_repeat; i++)
+            execute(prepeat->p_statement.get(), sc, mask);
+        return;
+    }
+
+    if (auto pif = dynamic_cast<const if_statement*>(s))
+    {
+        auto condition = evaluate(pif->p_expression.get(), sc);
+        if (condition->type != column_type::bool_value)
+            throw runtime_exception("type mismatch for if condition, must be bool");
+        vector<char> narrowed(lanes);
+        for (size_t i = 0; i < lanes; i++)
+            narrowed[i] = mask[i] & (condition->values[i] != 0);
+        if (any_lane(narrowed))
+            execute(pif->p_statement.get(), sc, narrowed);
+        return;
+    }
+
+    if (auto pdef = dynamic_cast<def_statement*>(s))
+    {
+        if (!all_lanes(mask))
+            throw runtime_exception("def " + pdef->name + " under a condition that differs between lanes");
+        sc.functions.insert(make_pair(pdef->name, pdef));
+        return;
+    }
+
+    throw runtime_exception("impossible: unknown statement in lockstep execution");
+}
+
+void spmd_executor::call(const function_call* pcall, scope& sc, const vector<char>& mask)
+{
+    vector<shared_ptr<const column>> args;
+    for (auto& param : pcall->p_params->params)
+        args.push_back(evaluate(param.get(), sc));
+
+    auto call_per_lane = [&](const installed_function* p_function)
+    {
+        vector<shared_ptr<value>> boxed(args.size());
+        for (size_t lane = 0; lane < lanes; lane++)
+        {
+            if (!mask[lane])
+                continue;
+            for (size_t i = 0; i < args.size(); i++)
+                boxed[i] = box(*args[i], lane);
+            p_function->function(host, boxed);
+        }
+    };
+
+    int native_id = pcall->binding.native_id;
+    if (native_id >= 0)
+    {
+        if (batched[native_id])
+        {
+            vector<const column*> columns;
+            for (auto& arg : args)
+                columns.push_back(arg.get());
+            batched[native_id](host, columns, mask);
+        }
+        else
+            call_per_lane(host.get_native(native_id));
+        return;
+    }
+
+    const scope* p_owner = &sc;
+    int hops = pcall->binding.scope_hops;
+    for (; hops > 0 && p_owner != nullptr; hops--)
+        p_owner = p_owner->p_outer;
+    if (p_owner == nullptr)
+    {
+        // a script function of the host's records, e.g. of a snapshot's prelude: the host record stands
+        // for the program's top scope's outer one
+        auto p_record = host.get_outer(hops);
+        auto p_function = p_record != nullptr ? p_record->get_local_func(pcall->function_name) : nullptr;
+        if (p_function == nullptr)
+            throw runtime_exception("impossible: cannot find function in name scope");
+        return call_per_lane(p_function);
+    }
+
+    auto pdef = p_owner->functions.find(pcall->function_name);
+    if (pdef == p_owner->functions.end())
+        throw runtime_exception("impossible: cannot find function in name scope");
+    auto p_def = pdef->second;
+    auto p_body = p_def->body(host);
+    if (!p_body)
+        return;
+    scope params(p_owner);
+    for (size_t i = 0; i < args.size(); i++)
+        params.vars.insert(make_pair(p_def->argnames[i], args[i]));
+    execute(p_body, params, mask);
+}
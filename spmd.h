@@ -0,0 +1,62 @@
+#ifndef SPMD_H
+#define SPMD_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+
+#include "nodes.h"
+
+using namespace std;
+
+// a value for each lane. all lanes of a column have the same type; ints, durations (in seconds)
+// and bools are all stored as int64, so that the columns can be processed as plain arrays
+enum class column_type { int_value, seconds_value, bool_value };
+
+struct column
+{
+    column_type type;
+    vector<long long> values;
+};
+
+// a native called once for all lanes: the arguments come as columns, and only the lanes whose mask
+// entry is set take part in the call
+typedef function<void(const activation_record&, const vector<const column*>&, const vector<char>&)> batched_native;
+
+/*
+lockstep (SPMD) execution of one program for many parameter sets, the lanes. every statement is
+interpreted once for all lanes, with the values held in columns: an if narrows the mask of active lanes
+to those whose condition holds, and the branch runs only if any lane is left. calls of natives with a
+batched version are made once per statement; the other natives are called lane by lane, in lane order,
+with boxed values. so the output of the lanes comes interleaved statement by statement, instead of one
+instance after another.
+a def executed while only part of the lanes are active would define different functions for
+different lanes; this is not supported, and reported as a runtime error
+*/
+class spmd_executor
+{
+    const activation_record& host;
+    const size_t lanes;
+    // by native id
+    vector<batched_native> batched;
+    unordered_map<const expr*, shared_ptr<const column>> constants;
+
+    struct scope;
+    shared_ptr<const column> evaluate(const expr* e, const scope& sc);
+    void execute(statement* s, scope& sc, const vector<char>& mask);
+    void call(const function_call* pcall, scope& sc, const vector<char>& mask);
+
+public:
+    spmd_executor(const activation_record& host, size_t lanes);
+
+    // from now on the native with this name and number of arguments is called once for all lanes
+    void install_batched(const string& name, int argnum, batched_native f);
+
+    // executes the top level of the program for all lanes, then calls the top-level def `entry`
+    // with an argument column for each of its parameters. throws runtime_exception on errors
+    void run(const program& p, const string& entry, const vector<column>& args);
+};
+
+#endif
\ No newline at end of file
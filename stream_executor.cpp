@@ -0,0 +1,105 @@
+#include "stdafx.h"
+#include "stream_executor.h"
+
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "parser.h"
+
+namespace
+{
+    class statement_queue
+    {
+        const size_t capacity;
+        deque<unique_ptr<statement>> statements;
+        mutex queue_mutex;
+        condition_variable not_empty;
+        condition_variable not_full;
+        bool closed = false;
+
+    public:
+        explicit statement_queue(size_t capacity) : capacity(max(capacity, (size_t)1))
+        {
+        }
+
+        // false if the queue was closed by the consumer
+        bool push(unique_ptr<statement> s)
+        {
+            unique_lock<mutex> lock(queue_mutex);
+            not_full.wait(lock, [this] { return closed || statements.size() < capacity; });
+            if (closed)
+                return false;
+            statements.push_back(move(s));
+            not_empty.notify_one();
+            return true;
+        }
+
+        // false once the queue is closed and drained
+        bool pop(unique_ptr<statement>& s)
+        {
+            unique_lock<mutex> lock(queue_mutex);
+            not_empty.wait(lock, [this] { return closed || !statements.empty(); });
+            if (statements.empty())
+                return false;
+            s = move(statements.front());
+            statements.pop_front();
+            not_full.notify_one();
+            return true;
+        }
+
+        void close()
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            closed = true;
+            not_empty.notify_all();
+            not_full.notify_all();
+        }
+    };
+}
+
+script_result execute_stream(istream& input, activation_record& r, size_t capacity)
+{
+    statement_queue queue(capacity);
+    script_result run_result;
+    auto p_out = output_stream();
+    thread executor([&]
+    {
+        output_stream() = p_out;
+        // the executed statements stay alive with the record: its functions are closures over def statements
+        vector<unique_ptr<statement>> executed;
+        activation_record top_level(&r, &run_result);
+        unique_ptr<statement> s;
+        while (queue.pop(s))
+        {
+            try
+            {
+                s->execute(top_level);
+            }
+            catch (const runtime_exception& ex)
+            {
+                // thrown by a native not using activation_record::fail
+                top_level.fail(ex.text);
+            }
+            executed.push_back(move(s));
+            if (top_level.failed())
+            {
+                queue.close();
+                break;
+            }
+        }
+    });
+
+    script_result parse_result;
+    parser p(input);
+    while (true)
+    {
+        statement* s = p.try_parse_next(r.get_ns(), parse_result);
+        if (!s || !queue.push(unique_ptr<statement>(s)))
+            break;
+    }
+    queue.close();
+    executor.join();
+    return run_result.ok() ? parse_result : run_result;
+}
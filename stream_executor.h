@@ -0,0 +1,20 @@
+#ifndef STREAM_EXECUTOR_H
+#define STREAM_EXECUTOR_H
+
+#include <istream>
+
+#include "nodes.h"
+
+using namespace std;
+
+/*
+pipelined parse and execute for scripts arriving as a stream: each top-level statement is executed
+as soon as it is parsed, on a thread of its own, while the parser reads on. the two are connected by
+a queue of at most `capacity` statements, so a slow executor holds the parser back.
+the statements run in order in one record standing for the program's top level, so a def serves all
+statements after it, as in a program parsed at once. unlike there, the statements before a parse error
+do run. returns the first error, the runtime errors of the executed statements taking precedence
+*/
+script_result execute_stream(istream& input, activation_record& r, size_t capacity = 64);
+
+#endif
\ No newline at end of file
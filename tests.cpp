@@ -0,0 +1,911 @@
+#include "stdafx.h"
+#include "tests.h"
+
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include "parser.h"
+#include "installed_functions.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "optimizer.h"
+#include "dedup.h"
+#include "daemon.h"
+#include "execution_clock.h"
+#include "transpiler.h"
+#include "compiled_script.h"
+#include "program_registry.h"
+#include "stream_executor.h"
+#include "spmd.h"
+
+namespace
+{
+    int failures = 0;
+    // see run_tests
+    string compile_command;
+
+    void check(bool condition, const string& what)
+    {
+        if (condition)
+            return;
+        failures++;
+        cout << "    FAILED: " << what << endl;
+    }
+
+    // a host with the builtin natives
+    struct builtin_host
+    {
+        native_table builtins;
+        activation_record r;
+
+        builtin_host() : builtins(builtin_natives)
+        {
+            r.install_natives(builtins);
+        }
+    };
+
+    // collects what the natives write while it lives
+    class captured_output
+    {
+        ostringstream text;
+        ostream* p_saved;
+
+    public:
+        captured_output() : p_saved(output_stream())
+        {
+            output_stream() = &text;
+        }
+
+        ~captured_output()
+        {
+            output_stream() = p_saved;
+        }
+
+        string str() const
+        {
+            return text.str();
+        }
+    };
+
+    // collects what goes to cout while it lives, also from the natives of a compiled script, which have
+    // output_stream() of their own
+    class captured_cout
+    {
+        ostringstream text;
+        streambuf* p_saved;
+
+    public:
+        captured_cout() : p_saved(cout.rdbuf(text.rdbuf()))
+        {
+        }
+
+        ~captured_cout()
+        {
+            cout.rdbuf(p_saved);
+        }
+
+        string str() const
+        {
+            return text.str();
+        }
+    };
+
+    string run(const string& script, activation_record& r, bool lazy_defs = false)
+    {
+        unique_ptr<program> p(parser(script, lazy_defs).parse(r.get_ns()));
+        captured_output out;
+        p->execute(r);
+        return out.str();
+    }
+
+    void f_nothing(const activation_record&, const vector<shared_ptr<value>>&)
+    {
+    }
+
+    void test_native_table()
+    {
+        const int count = 5000;
+        // the descriptors point into names
+        vector<string> names;
+        for (int i = 0; i < count; i++)
+            names.push_back("native" + to_string(i));
+        vector<native_descriptor> descriptors;
+        for (int i = 0; i < count; i++)
+            descriptors.push_back(native_descriptor { names[i].c_str(), 1, f_nothing, na_none });
+        // later natives of the same names, which lose
+        for (int i = 0; i < count; i += 7)
+            descriptors.push_back(native_descriptor { names[i].c_str(), 2, f_nothing, na_thread_safe });
+
+        native_table table(descriptors.data(), descriptors.data() + descriptors.size());
+        bool all_found = table.size() == (size_t)count;
+        for (int i = 0; all_found && i < count; i++)
+        {
+            int index = table.find(names[i]);
+            all_found = index >= 0 && names[i] == table.descriptor(index).name && table.descriptor(index).argnum == 1 &&
+                        table.function(index).attributes == na_none;
+        }
+        check(all_found, "every native of a large table is found, the first of a name winning");
+        check(table.find("native" + to_string(count)) == -1 && table.find("nativ") == -1 && table.find("") == -1,
+              "names not in the table are not found");
+    }
+
+    void test_keywords()
+    {
+        tokenizer t("iff de repeats i parallelx if def repeat parallel true false");
+        vector<token_type> types;
+        vector<string> idents;
+        for (auto tok = t.peek_next(); tok.type != tt_eof; t.move_ahead(), tok = t.peek_next())
+        {
+            types.push_back(tok.type);
+            if (tok.type == tt_ident)
+                idents.push_back(tok.string_value);
+        }
+        check(types == vector<token_type>({ tt_ident, tt_ident, tt_ident, tt_ident, tt_ident,
+                                            tt_if, tt_def, tt_repeat, tt_parallel, tt_boolval, tt_boolval }) &&
+              idents == vector<string>({ "iff", "de", "repeats", "i", "parallelx" }),
+              "identifiers close to keywords are identifiers");
+    }
+
+    void test_lazy_defs()
+    {
+        builtin_host host;
+        // the body of g is malformed, but g is never called
+        unique_ptr<program> p(parser("def g() { click(1 } def f(x) { dump(x) } f(3)", true).parse(host.r.get_ns()));
+        auto pdef = dynamic_cast<def_statement*>(p->statements[1].get());
+        check(pdef != nullptr && !pdef->p_statement, "a lazy def body is not parsed before the first call");
+        {
+            captured_output out;
+            p->execute(host.r);
+            check(out.str() == "dump: 3 (int)\n", "a lazily parsed def runs when called");
+        }
+        check(pdef != nullptr && pdef->p_statement, "a lazy def body is parsed on the first call");
+
+        unique_ptr<program> bad(parser("def g() { click(1 }\ng()", true).parse(host.r.get_ns()));
+        auto result = bad->try_execute(host.r);
+        check(result.status == result_status::parse_error && result.row == 1,
+              "a malformed lazy def body is reported as a parse error when called");
+    }
+
+    void test_call_binding()
+    {
+        builtin_host host;
+        unique_ptr<program> p(parser("pause(1s) def f(x) { click(x, x) } { f(2) }").parse(host.r.get_ns()));
+        auto pnative = dynamic_cast<function_call*>(p->statements[0].get());
+        check(pnative != nullptr && pnative->binding.native_id >= 0, "a native call is bound to a native id");
+        auto pblock = dynamic_cast<compound_statement*>(p->statements[2].get());
+        auto pcall = pblock != nullptr ? dynamic_cast<function_call*>(pblock->statements[0].get()) : nullptr;
+        check(pcall != nullptr && pcall->binding.native_id < 0 && pcall->binding.scope_hops == 1,
+              "a script function call is bound to the record levels up to its def");
+
+        check(run("def dump(x) { click(x, x) } dump(2) { def f(x) { dump(x) } { f(4) } }", host.r) ==
+              "click: (2, 2)\nclick: (4, 4)\n", "a def shadows the native of the same name");
+        check(run("def f(x) { dump(x) } repeat(2) { def f(x) { click(x, x) } f(1) } f(5)", host.r) ==
+              "click: (1, 1)\nclick: (1, 1)\ndump: 5 (int)\n", "calls find the def of their own scope");
+
+        // a host function installed below the root has no native id, and is found by scope_hops
+        activation_record child(&host.r);
+        child.install_function([](const activation_record&, const vector<shared_ptr<value>>&)
+        {
+            *output_stream() << "mine" << endl;
+        }, 1, "mine");
+        check(run("mine(1) { repeat(2) { mine(2) } }", child) == "mine\nmine\nmine\n",
+              "a host function of an inner record is found");
+    }
+
+    string run_optimized(const string& script, activation_record& r)
+    {
+        unique_ptr<program> p(parser(script).parse(r.get_ns()));
+        optimize(*p);
+        captured_output out;
+        p->execute(r);
+        return out.str();
+    }
+
+    void test_optimizer()
+    {
+        builtin_host host;
+        check(run_optimized("def f(x) { click(x, 1) } def g(x) { f(x) dump(x) } { g(2) } def unused() { }", host.r) ==
+              "click: (2, 1)\ndump: 2 (int)\n", "inlined defs do what they did");
+
+        // calls to functions of the host's records keep their bindings, and move with an inlined body
+        activation_record child(&host.r);
+        child.install_function([](const activation_record&, const vector<shared_ptr<value>>& args)
+        {
+            *output_stream() << "mine: " << static_cast<typed_value<int>*>(args[0].get())->value << endl;
+        }, 1, "mine");
+        check(run_optimized("def f(x) { mine(x) } { { { f(1) } } } f(2) mine(3)", child) == "mine: 1\nmine: 2\nmine: 3\n",
+              "host functions are found from inlined bodies");
+
+        snapshot prelude(host.r, "def g(x) { dump(x) }");
+        auto context = prelude.fork();
+        check(run_optimized("{ g(3) } g(4)", *context) == "dump: 3 (int)\ndump: 4 (int)\n",
+              "functions of a snapshot's prelude are found after optimizing");
+
+        for (bool keep : { false, true })
+        {
+            unique_ptr<program> p(parser("def h(x) { dump(x) } def k() { h(1) } { def nested() { } }").parse(host.r.get_ns()));
+            optimize(*p, 8, keep);
+            auto pblock = dynamic_cast<compound_statement*>(p->statements.back().get());
+            check(p->statements.size() == (keep ? 3 : 1) && pblock != nullptr && pblock->statements.empty(),
+                  keep ? "the top-level defs of a prelude can be kept" : "unused defs are removed");
+        }
+    }
+
+    void test_dedup()
+    {
+        builtin_host host;
+        activation_record child(&host.r);
+        int calls = 0;
+        child.install_function([&calls](const activation_record& r, const vector<shared_ptr<value>>&)
+        {
+            if (++calls == 2)
+                r.fail("second call");
+        }, 1, "once");
+        const string script = "once(1)\nonce(1)";
+
+        unique_ptr<program> shared(parser(script).parse(child.get_ns()));
+        share_identical_subtrees(*shared);
+        check(shared->statements[0] == shared->statements[1], "identical calls are shared");
+
+        source_map positions;
+        parser mapped(script);
+        mapped.set_source_map(&positions);
+        unique_ptr<program> p(mapped.parse(child.get_ns()));
+        share_identical_subtrees(*p, &positions);
+        auto result = p->try_execute(child);
+        auto pfound = positions.find(result.p_node);
+        check(result.status == result_status::runtime_error && pfound != nullptr && pfound->size() == 1 &&
+              (*pfound)[0].row == 2, "with a source map, a fault is found at the one position it came from");
+        auto pfirst = dynamic_cast<function_call*>(p->statements[0].get());
+        auto psecond = dynamic_cast<function_call*>(p->statements[1].get());
+        check(pfirst != nullptr && psecond != nullptr && pfirst != psecond &&
+              pfirst->p_params->params[0] == psecond->p_params->params[0], "expressions are shared with a source map too");
+    }
+
+    void test_parser_reuse()
+    {
+        // the buffer is reused unless something else shares it
+        tokenizer t("dump(1)");
+        auto p_first = t.get_text().get();
+        t.reset("dump(2)");
+        check(t.get_text().get() == p_first && *t.get_text() == "dump(2)", "a reset tokenizer reuses its buffer");
+        auto p_kept = t.get_text();
+        t.reset("dump(3)");
+        check(*p_kept == "dump(2)" && *t.get_text() == "dump(3)", "a reset leaves a shared buffer alone");
+
+        builtin_host host;
+        parser p("def f(x) { dump(x) } def g() { dump(2) } f(1)", true);
+        unique_ptr<program> lazy(p.parse(host.r.get_ns()));
+        p.reset("click(5, 6) click(7, 8) click(9, 10)");
+        unique_ptr<program> next(p.parse(host.r.get_ns()));
+        {
+            captured_output out;
+            lazy->execute(host.r);
+            next->execute(host.r);
+            check(out.str() == "dump: 1 (int)\nclick: (5, 6)\nclick: (7, 8)\nclick: (9, 10)\n",
+                  "the deferred bodies of a lazy parse keep their text over a reset");
+        }
+
+        vector<string> sources;
+        for (int i = 0; i < 64; i++)
+            sources.push_back(i % 3 == 2 ? "dump(" + to_string(i) : "dump(" + to_string(i) + ")");
+        vector<script_result> results;
+        auto programs = parse_batch(sources, host.r.get_ns(), results, true);
+        bool all_match = programs.size() == sources.size() && results.size() == sources.size();
+        for (size_t i = 0; all_match && i < sources.size(); i++)
+        {
+            if (i % 3 == 2)
+            {
+                all_match = programs[i] == nullptr && results[i].status == result_status::parse_error;
+                continue;
+            }
+            captured_output out;
+            all_match = programs[i] != nullptr && results[i].ok();
+            if (all_match)
+                programs[i]->execute(host.r);
+            all_match = all_match && out.str() == "dump: " + to_string(i) + " (int)\n";
+        }
+        check(all_match, "a parallel batch parse reports every source at its own index");
+    }
+
+    void test_exception_free_path()
+    {
+        builtin_host host;
+        script_result result;
+        check(parser("click(1, 2").try_parse(host.r.get_ns(), result) == nullptr &&
+              result.status == result_status::parse_error && result.row == 1, "try_parse reports a parse error");
+
+        unique_ptr<program> p(parser("dump(1)\nif (3) { dump(2) }\ndump(4)").parse(host.r.get_ns()));
+        {
+            captured_output out;
+            result = p->try_execute(host.r);
+            check(out.str() == "dump: 1 (int)\n", "try_execute stops at the first runtime error");
+        }
+        check(result.status == result_status::runtime_error && result.p_node == p->statements[1].get(),
+              "try_execute reports the runtime error and the statement it happened in");
+
+        // calls bound by scope_hops reach past the record try_execute reports through
+        snapshot warm(host.r, "def f(x) { dump(x) }");
+        auto context = warm.fork();
+        unique_ptr<program> forked(parser("f(2)").parse(context->get_ns()));
+        {
+            captured_output out;
+            result = forked->try_execute(*context);
+            check(result.ok() && out.str() == "dump: 2 (int)\n", "try_execute finds the defs of a snapshot's prelude");
+        }
+
+        activation_record child(&host.r);
+        child.install_function([](const activation_record& r, const vector<shared_ptr<value>>&)
+        {
+            r.fail("mine failed");
+        }, 1, "mine");
+        unique_ptr<program> failing(parser("{ mine(1) }").parse(child.get_ns()));
+        result = failing->try_execute(child);
+        check(result.status == result_status::runtime_error && result.text == "mine failed",
+              "try_execute finds a host function of an inner record, and reports its failure");
+    }
+
+    void test_parallel_repeat()
+    {
+        builtin_host host;
+        check(run("def f(x) { click(x, 1) } parallel repeat(2) { f(3) dump(true) }", host.r) ==
+              "click: (3, 1)\ndump: true (bool)\nclick: (3, 1)\ndump: true (bool)\n",
+              "a parallel body calls a script def, and its output comes in iteration order");
+        check(run("parallel repeat(2) { def g(x) { dump(x) } g(1) parallel repeat(2) { g(2) } }", host.r) ==
+              "dump: 1 (int)\ndump: 2 (int)\ndump: 2 (int)\ndump: 1 (int)\ndump: 2 (int)\ndump: 2 (int)\n",
+              "defs of a parallel body are found from nested parallel repeats");
+
+        // host functions of an inner record: a thread-safe one is called right away, the other one is buffered
+        // and called after all iterations
+        activation_record child(&host.r);
+        auto p_ticks = make_shared<atomic<int>>(0);
+        child.install_function([p_ticks](const activation_record&, const vector<shared_ptr<value>>&)
+        {
+            (*p_ticks)++;
+        }, 1, "tick", na_thread_safe);
+        child.install_function([p_ticks](const activation_record&, const vector<shared_ptr<value>>&)
+        {
+            *output_stream() << *p_ticks << endl;
+        }, 1, "show");
+        check(run("repeat(3) { tick(1) show(1) }", child) == "1\n2\n3\n", "a plain repeat calls host functions in turn");
+        *p_ticks = 0;
+        check(run("parallel repeat(3) { tick(1) show(1) }", child) == "3\n3\n3\n",
+              "a parallel repeat buffers the host functions that are not thread safe");
+
+        child.install_function([](const activation_record&, const vector<shared_ptr<value>>& args)
+        {
+            *output_stream() << static_cast<typed_value<int>*>(args[0].get())->value << endl;
+        }, 1, "say");
+        check(run("parallel repeat(64) { parallel repeat(2) { say(1) } say(2) }", child) ==
+              run("repeat(64) { repeat(2) { say(1) } say(2) }", child),
+              "a nested parallel repeat buffers its host functions into the enclosing one");
+
+        unique_ptr<program> failing(parser("parallel repeat(3) { dump(1) if (2) { } }").parse(host.r.get_ns()));
+        captured_output out;
+        auto result = failing->try_execute(host.r);
+        check(result.status == result_status::runtime_error && out.str() == "dump: 1 (int)\n",
+              "a failed iteration stops the replay at its error");
+    }
+
+    void test_trace()
+    {
+        builtin_host host;
+        // the natives of the root record get ids; check fails for 2
+        host.r.install_function([](const activation_record& r, const vector<shared_ptr<value>>& args)
+        {
+            auto x = static_cast<typed_value<int>*>(args[0].get())->value;
+            *output_stream() << "check " << x << endl;
+            if (x == 2)
+                r.fail("check failed");
+        }, 1, "check");
+
+        snapshot warm(host.r, "def f(x) { click(x, x) }");
+        auto context = warm.fork();
+        unique_ptr<program> p(parser("repeat(3) { f(1) dump(2) }").parse(context->get_ns()));
+        unique_ptr<trace> t;
+        {
+            captured_output out;
+            t.reset(record_trace(*p, *context));
+            check(out.str().empty(), "recording calls no natives");
+        }
+        check(t != nullptr, "a program calling a snapshot's prelude defs is recorded");
+        if (t)
+        {
+            captured_output out;
+            t->replay(*context);
+            check(out.str() == run("repeat(3) { f(1) dump(2) }", *context), "the replay does what the program does");
+        }
+
+        activation_record child(&host.r);
+        bool called = false;
+        child.install_function([&called](const activation_record&, const vector<shared_ptr<value>>&)
+        {
+            called = true;
+        }, 1, "mine");
+        unique_ptr<program> calls_host(parser("dump(1) mine(1)").parse(child.get_ns()));
+        t.reset(record_trace(*calls_host, child));
+        check(t == nullptr && !called, "a program calling a host function of an inner record is not recorded, "
+              "and the function is not called");
+        unique_ptr<program> parallel_calls_host(parser("parallel repeat(2) { mine(1) dump(1) }").parse(child.get_ns()));
+        t.reset(record_trace(*parallel_calls_host, child));
+        check(t == nullptr && !called, "a parallel body calling a host function of an inner record is not recorded either");
+
+        unique_ptr<program> failing(parser("repeat(3) { check(1) check(2) dump(3) }").parse(host.r.get_ns()));
+        t.reset(record_trace(*failing, host.r));
+        check(t != nullptr, "natives are recorded without being called");
+        if (t)
+        {
+            script_result result;
+            activation_record checked(&host.r, &result);
+            captured_output out;
+            t->replay(checked);
+            check(result.text == "check failed" && out.str() == "check 1\ncheck 2\n",
+                  "a replay without exceptions stops at the first failed call");
+        }
+    }
+
+    void test_daemon()
+    {
+        builtin_host host;
+        {
+            script_daemon daemon(host.r, 1, 1024, 100);
+            istringstream in("run z 99999999999999\nquit\n");
+            ostringstream out;
+            daemon.serve(in, out);
+            check(out.str().find("error script too large for z") == 0, "a script over the maximum size is refused");
+        }
+        {
+            script_daemon daemon(host.r, 1, 1024, 100);
+            istringstream in("run a 200\n" + string(200, ' ') + "run b 7\ndump(1)quit\n");
+            ostringstream out;
+            daemon.serve(in, out);
+            check(out.str().find("out b dump: 1 (int)") != string::npos, "the text of a refused script is skipped");
+        }
+        for (size_t capacity : { 0, 1 })
+        {
+            script_daemon daemon(host.r, 1, capacity);
+            istringstream in("run a 7\ndump(1)run b 7\ndump(2)run c 7\ndump(1)quit\n");
+            ostringstream out;
+            daemon.serve(in, out);
+            auto text = out.str();
+            check(text.find("done a ok") != string::npos && text.find("done b ok") != string::npos &&
+                  text.find("done c ok") != string::npos, "the daemon runs scripts with cache capacity " + to_string(capacity));
+        }
+    }
+
+    void test_timer_wheel()
+    {
+        timer_wheel wheel;
+        vector<unsigned long long> fired;
+        // in the first wheel, cascaded from the second and third, and in the overflow list
+        for (unsigned long long delay : { 1ULL, 5ULL, 64ULL, 100ULL, 5000ULL, 20000000ULL })
+            wheel.add(delay, [&fired, &wheel] { fired.push_back(wheel.now()); });
+        vector<function<void()>> expired;
+        wheel.advance_to(20000000, expired);
+        for (auto& callback : expired)
+            callback();
+        check(wheel.size() == 0 && fired == vector<unsigned long long>(6, 20000000), "advance_to expires every timer on its way");
+
+        // each timer expires at its own tick
+        for (unsigned long long delay : { 3ULL, 70ULL, 4100ULL })
+            wheel.add(delay, nullptr);
+        vector<unsigned long long> ticks;
+        while (wheel.size() > 0)
+        {
+            expired.clear();
+            wheel.advance(expired);
+            if (!expired.empty())
+                ticks.push_back(wheel.now() - 20000000);
+        }
+        check(ticks == vector<unsigned long long>({ 3, 70, 4100 }), "timers expire at their tick");
+
+        // with nothing pending the wheel jumps
+        wheel.advance_to(30000000, expired);
+        check(wheel.now() == 30000000, "an empty wheel jumps to the tick");
+    }
+
+    void test_real_time_clock()
+    {
+        real_time_clock clock(chrono::milliseconds(10));
+        atomic<bool> fired(false);
+        // a slow callback holds the ticker up past the timer behind it
+        clock.schedule(chrono::milliseconds(10), [] { this_thread::sleep_for(chrono::milliseconds(200)); });
+        clock.schedule(chrono::milliseconds(30), [&fired] { fired = true; });
+        this_thread::sleep_for(chrono::milliseconds(100));
+        // scheduling meanwhile must not skip the wheel over the pending timer
+        clock.schedule(chrono::milliseconds(10), [] { });
+        for (int i = 0; i < 100 && !fired; i++)
+            this_thread::sleep_for(chrono::milliseconds(10));
+        check(fired, "a timer runs after a slow callback even if a timer is scheduled meanwhile");
+
+        auto before = clock.now();
+        clock.pause(chrono::milliseconds(30));
+        check(clock.now() - before >= chrono::milliseconds(30), "a pause lasts at least its duration");
+    }
+
+    void test_virtual_clock()
+    {
+        virtual_clock clock;
+        string order;
+        auto script = [&](char name, int step)
+        {
+            return [&clock, &order, name, step]
+            {
+                for (int i = 0; i < 3; i++)
+                {
+                    order += name;
+                    clock.pause(chrono::milliseconds(step));
+                }
+            };
+        };
+        clock.run({ script('a', 20), script('b', 30) });
+        // a at 0, 20, 40 and b at 0, 30, 60; ties go to the script that paused first
+        check(order == "ababab" && clock.now() == chrono::milliseconds(90), "scripts interleave by their wake-up times");
+    }
+
+    void test_spmd()
+    {
+        builtin_host host;
+        unique_ptr<program> p(parser("def main(x, flag) { click(x, 1) if (flag) { click(x, 2) dump(x) } }")
+                              .parse(host.r.get_ns()));
+        spmd_executor executor(host.r, 4);
+        // the columns and the mask of every batched call
+        vector<vector<long long>> clicks;
+        executor.install_batched("click", 2, [&clicks](const activation_record&, const vector<const column*>& args,
+                                                       const vector<char>& mask)
+        {
+            clicks.push_back(args[0]->values);
+            clicks.push_back(args[1]->values);
+            clicks.push_back(vector<long long>(mask.begin(), mask.end()));
+        });
+        {
+            captured_output out;
+            executor.run(*p, "main", { column { column_type::int_value, { 10, 20, 30, 40 } },
+                                       column { column_type::bool_value, { 1, 0, 1, 0 } } });
+            check(out.str() == "dump: 10 (int)\ndump: 30 (int)\n",
+                  "a native without a batched version is called per active lane");
+        }
+        vector<vector<long long>> expected =
+        {
+            { 10, 20, 30, 40 }, { 1, 1, 1, 1 }, { 1, 1, 1, 1 },
+            { 10, 20, 30, 40 }, { 2, 2, 2, 2 }, { 1, 0, 1, 0 },
+        };
+        check(clicks == expected, "a batched native gets all lanes' columns, and an if narrows the mask");
+
+        unique_ptr<program> divergent(parser("def main(flag) { if (flag) { def g() { } } }").parse(host.r.get_ns()));
+        spmd_executor two_lanes(host.r, 2);
+        two_lanes.run(*divergent, "main", { column { column_type::bool_value, { 1, 1 } } });
+        bool refused = false;
+        try
+        {
+            two_lanes.run(*divergent, "main", { column { column_type::bool_value, { 1, 0 } } });
+        }
+        catch (const runtime_exception& ex)
+        {
+            refused = ex.text == "def g under a condition that differs between lanes";
+        }
+        check(refused, "a def under a condition that differs between lanes is an error");
+    }
+
+    // input arriving in pieces, as from a pipe: reading waits for the next piece
+    class piped_input : public streambuf
+    {
+        mutex pipe_mutex;
+        condition_variable pipe_cv;
+        deque<string> pieces;
+        string current;
+        bool closed = false;
+
+    protected:
+        virtual int_type underflow()
+        {
+            unique_lock<mutex> lock(pipe_mutex);
+            pipe_cv.wait(lock, [this] { return closed || !pieces.empty(); });
+            if (pieces.empty())
+                return traits_type::eof();
+            current = move(pieces.front());
+            pieces.pop_front();
+            setg(&current[0], &current[0], &current[0] + current.length());
+            return traits_type::to_int_type(current[0]);
+        }
+
+    public:
+        void write(const string& text)
+        {
+            lock_guard<mutex> lock(pipe_mutex);
+            if (!text.empty())
+                pieces.push_back(text);
+            pipe_cv.notify_all();
+        }
+
+        void close()
+        {
+            lock_guard<mutex> lock(pipe_mutex);
+            closed = true;
+            pipe_cv.notify_all();
+        }
+    };
+
+    void test_stream_executor()
+    {
+        builtin_host host;
+        {
+            istringstream in("def f(x) { dump(x) }\nf(1)\nf(2)\n");
+            captured_output out;
+            auto result = execute_stream(in, host.r);
+            check(result.ok() && out.str() == "dump: 1 (int)\ndump: 2 (int)\n",
+                  "a streamed def serves the statements after it");
+        }
+        {
+            istringstream in("dump(1)\ndump(2)\nclick(3\ndump(4)\n");
+            captured_output out;
+            auto result = execute_stream(in, host.r);
+            check(result.status == result_status::parse_error && result.row == 4 &&
+                  out.str() == "dump: 1 (int)\ndump: 2 (int)\n", "the statements before a parse error run");
+        }
+        {
+            // far more statements than the queue holds: the parser must not wait for room forever
+            string script = "dump(1)\nif (3) { }\n";
+            for (int i = 0; i < 100; i++)
+                script += "dump(2)\n";
+            istringstream in(script);
+            captured_output out;
+            auto result = execute_stream(in, host.r, 2);
+            check(result.status == result_status::runtime_error &&
+                  result.text == "type mismatch for if condition, must be bool" && out.str() == "dump: 1 (int)\n",
+                  "a runtime error stops the stream");
+        }
+
+        // a statement runs before the line after it arrives
+        activation_record child(&host.r);
+        atomic<bool> marked(false);
+        child.install_function([&marked](const activation_record&, const vector<shared_ptr<value>>&)
+        {
+            marked = true;
+        }, 1, "mark");
+        piped_input pipe;
+        istream in(&pipe);
+        bool marked_in_time = false;
+        thread writer([&]
+        {
+            pipe.write("mark(1)\n");
+            for (int i = 0; i < 200 && !marked; i++)
+                this_thread::sleep_for(chrono::milliseconds(10));
+            marked_in_time = marked;
+            pipe.write("dump(2)\n");
+            pipe.close();
+        });
+        captured_output out;
+        auto result = execute_stream(in, child);
+        writer.join();
+        check(marked_in_time && result.ok() && out.str() == "dump: 2 (int)\n",
+              "a streamed statement runs without waiting for the next line");
+    }
+
+    // a statement telling when its tree is freed
+    struct watched_statement : public statement
+    {
+        shared_ptr<atomic<bool>> p_freed;
+
+        explicit watched_statement(shared_ptr<atomic<bool>> p_freed) : p_freed(p_freed) { }
+        virtual void execute(activation_record&) { }
+        virtual ~watched_statement()
+        {
+            *p_freed = true;
+        }
+    };
+
+    void test_program_registry()
+    {
+        builtin_host host;
+        {
+            program_registry registry(2);
+            program_registry::reader reader(registry);
+            {
+                auto empty = reader.pin();
+                check(empty.get() == nullptr && empty.number() == 0, "a pin before the first publish is empty");
+            }
+
+            auto p_freed = make_shared<atomic<bool>>(false);
+            unique_ptr<program> first(parser("dump(1)").parse(host.r.get_ns()));
+            first->statements.emplace_back(new watched_statement(p_freed));
+            registry.publish(move(first));
+            {
+                auto pin = reader.pin();
+                check(registry.publish(unique_ptr<program>(parser("dump(2)").parse(host.r.get_ns()))) == 2 &&
+                      pin.number() == 1, "publishing numbers the versions");
+                registry.collect();
+                check(!*p_freed && registry.retired_count() == 1, "a pinned version survives publish and collect");
+                captured_output out;
+                pin.get()->execute(host.r);
+                check(out.str() == "dump: 1 (int)\n", "a pinned version can be executed after it was replaced");
+            }
+            registry.collect();
+            check(*p_freed && registry.retired_count() == 0, "collect frees a version once it is unpinned");
+
+            program_registry::reader second(registry);
+            bool refused = false;
+            try
+            {
+                program_registry::reader third(registry);
+            }
+            catch (const runtime_exception& ex)
+            {
+                refused = ex.text == "no free reader slot in the program registry";
+            }
+            check(refused, "a reader beyond the registry's slots is refused");
+        }
+
+        // readers executing the current version while it is replaced, each execution giving the output
+        // of the version it pinned
+        const int nversions = 200;
+        vector<unique_ptr<program>> versions;
+        for (int i = 1; i <= nversions; i++)
+            versions.emplace_back(parser("dump(" + to_string(i) + ")").parse(host.r.get_ns()));
+        program_registry registry(4);
+        registry.publish(move(versions[0]));
+        atomic<bool> publishing(true);
+        atomic<int> mismatches(0);
+        vector<thread> readers;
+        for (int t = 0; t < 3; t++)
+        {
+            readers.emplace_back([&]
+            {
+                program_registry::reader reader(registry);
+                unsigned long last = 0;
+                while (publishing)
+                {
+                    auto pin = reader.pin();
+                    captured_output out;
+                    pin.get()->execute(host.r);
+                    if (out.str() != "dump: " + to_string(pin.number()) + " (int)\n" || pin.number() < last)
+                        mismatches++;
+                    last = pin.number();
+                }
+            });
+        }
+        for (int i = 1; i < nversions; i++)
+        {
+            registry.publish(move(versions[i]));
+            this_thread::yield();
+        }
+        publishing = false;
+        for (auto& t : readers)
+            t.join();
+        registry.collect();
+        check(mismatches == 0 && registry.retired_count() == 0,
+              "readers execute the version they pinned while another thread publishes");
+    }
+
+    string replaced(string command, const string& placeholder, const string& path)
+    {
+        for (auto pos = command.find(placeholder); pos != string::npos; pos = command.find(placeholder, pos + path.length()))
+            command.replace(pos, placeholder.length(), path);
+        return command;
+    }
+
+    // the same scripts, interpreted and compiled, give the same output and result
+    void test_compiled_scripts()
+    {
+        if (compile_command.empty())
+        {
+            cout << "    skipped, no compile command given" << endl;
+            return;
+        }
+        const char* scripts[] =
+        {
+            "def g(x, y) { def f(x) { dump(y) } def h(y) { f(y) } h(true) } g(1, 2)",
+            "repeat (3) { def f(x, y) { click(x, seven) if (y) { dump(false) } } f(1, true) "
+            "parallel repeat (2) { dump(seven) } }",
+            "def f(x) { if (x) { dump(x) } } f(true) f(false) { def f(x) { pause(x) } f(10s) }",
+            "dump(1)\nif (seven) { dump(2) }\ndump(3)",
+            "def f(x) { def g() { dump(x) } g() } f(1) repeat (2) { f(2) }",
+        };
+        transpile_target target;
+        target.includes.push_back("\"installed_functions.h\"");
+        target.natives = { { "pause", 1, "f_pause" }, { "click", 2, "f_click" }, { "dump", 1, "f_dump" } };
+
+        for (size_t i = 0; i < sizeof(scripts) / sizeof(scripts[0]); i++)
+        {
+            builtin_host host;
+            host.r.install_var(make_shared<typed_value<int>>(7), "seven");
+            unique_ptr<program> p(parser(scripts[i]).parse(host.r.get_ns()));
+            auto source = "compiled_test_" + to_string(i) + ".cpp";
+            auto library = "compiled_test_" + to_string(i);
+#ifdef _WIN32
+            library += ".dll";
+#else
+            library = "./" + library + ".so";
+#endif
+            {
+                ofstream out(source);
+                out << transpile(*p, target);
+            }
+            bool built = system(replaced(replaced(compile_command, "{source}", source), "{library}", library).c_str()) == 0;
+            check(built, string("script builds: ") + scripts[i]);
+            if (built)
+            {
+                script_result interpreted, compiled;
+                string interpreted_output, compiled_output;
+                {
+                    captured_cout out;
+                    interpreted = p->try_execute(host.r);
+                    interpreted_output = out.str();
+                }
+                {
+                    compiled_script script(library);
+                    captured_cout out;
+                    compiled = script.try_execute(host.r);
+                    compiled_output = out.str();
+                }
+                check(compiled_output == interpreted_output && compiled.status == interpreted.status &&
+                      compiled.text == interpreted.text,
+                      string("the compiled script does what the interpreter does: ") + scripts[i]);
+            }
+            remove(source.c_str());
+            remove(library.c_str());
+        }
+    }
+}
+
+int run_tests(const string& command)
+{
+    failures = 0;
+    compile_command = command;
+    const struct
+    {
+        const char* name;
+        void (*body)();
+    } tests[] =
+    {
+        { "native table", test_native_table },
+        { "keywords", test_keywords },
+        { "lazy defs", test_lazy_defs },
+        { "call binding", test_call_binding },
+        { "optimizer", test_optimizer },
+        { "dedup", test_dedup },
+        { "parser reuse", test_parser_reuse },
+        { "trace", test_trace },
+        { "daemon", test_daemon },
+        { "program registry", test_program_registry },
+        { "stream executor", test_stream_executor },
+        { "lockstep execution", test_spmd },
+        { "exception-free path", test_exception_free_path },
+        { "timer wheel", test_timer_wheel },
+        { "real time clock", test_real_time_clock },
+        { "virtual clock", test_virtual_clock },
+        { "parallel repeat", test_parallel_repeat },
+        { "compiled scripts", test_compiled_scripts },
+    };
+
+    for (auto& test : tests)
+    {
+        cout << test.name << endl;
+        try
+        {
+            test.body();
+        }
+        catch (const parse_exception& ex)
+        {
+            check(false, "parse exception: " + ex.text);
+        }
+        catch (const runtime_exception& ex)
+        {
+            check(false, "runtime exception: " + ex.text);
+        }
+    }
+    cout << (failures == 0 ? "all tests passed" : to_string(failures) + " checks failed") << endl;
+    return failures;
+}
@@ -0,0 +1,14 @@
+#ifndef TESTS_H
+#define TESTS_H
+
+#include <string>
+
+using namespace std;
+
+// regression tests of the interpreter, run with SimpleParser2 --test. prints the failed checks,
+// and returns their number. given a command building a transpiled script into a shared library, with
+// {source} and {library} in place of the paths, e.g. "g++ -std=c++14 -shared -fPIC -I. -o {library} {source}",
+// the compiled scripts are also compared with the interpreter
+int run_tests(const string& compile_command = string());
+
+#endif
\ No newline at end of file
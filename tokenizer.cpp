@@ -1,24 +1,113 @@
 #include "stdafx.h"
 #include "tokenizer.h"
 
+#include <cstring>
+#include <utility>
+
+namespace
+{
+    struct keyword
+    {
+        const char* name;
+        token_type type;
+        bool bool_value;
+    };
+
+    // true and false are listed here too, they are recognized the same way
+    constexpr keyword keywords[] =
+    {
+        { "repeat", tt_repeat, false },
+        { "if", tt_if, false },
+        { "def", tt_def, false },
+        { "parallel", tt_parallel, false },
+        { "true", tt_boolval, true },
+        { "false", tt_boolval, false },
+    };
+    constexpr int keyword_count = sizeof(keywords) / sizeof(keywords[0]);
+
+    // perfect hash of the keywords: the first two characters and the length of an identifier tell
+    // which keyword it can be, so a single string comparison decides whether it is one
+    constexpr int keyword_slots = 16;
+
+    constexpr int keyword_hash(char first, char second, int length)
+    {
+        return (first * 2 + second + length) & (keyword_slots - 1);
+    }
+
+    constexpr int name_length(const char* name)
+    {
+        return *name ? 1 + name_length(name + 1) : 0;
+    }
+
+    constexpr int keyword_hash(const char* name)
+    {
+        return keyword_hash(name[0], name[1], name_length(name));
+    }
+
+    constexpr bool collides(int i, int j)
+    {
+        return j < keyword_count && (keyword_hash(keywords[i].name) == keyword_hash(keywords[j].name) || collides(i, j + 1));
+    }
+
+    constexpr bool is_perfect(int i)
+    {
+        return i >= keyword_count || (!collides(i, i + 1) && is_perfect(i + 1));
+    }
+
+    static_assert(is_perfect(0), "keyword hash collision, change keyword_hash");
+
+    // the keyword in a slot, -1 for none
+    constexpr int keyword_in_slot(int slot, int i)
+    {
+        return i >= keyword_count ? -1 : keyword_hash(keywords[i].name) == slot ? i : keyword_in_slot(slot, i + 1);
+    }
+
+    struct slot_table
+    {
+        int slots[keyword_slots];
+    };
+
+    template<int... slots>
+    constexpr slot_table make_slot_table(integer_sequence<int, slots...>)
+    {
+        return slot_table { { keyword_in_slot(slots, 0)... } };
+    }
+
+    constexpr slot_table keyword_table = make_slot_table(make_integer_sequence<int, keyword_slots>());
+
+    const keyword* find_keyword(const char* begin, int length)
+    {
+        int k = keyword_table.slots[keyword_hash(begin[0], length > 1 ? begin[1] : 0, length)];
+        if (k < 0 || strncmp(keywords[k].name, begin, length) != 0 || keywords[k].name[length] != 0)
+            return nullptr;
+        return &keywords[k];
+    }
+}
+
 void tokenizer::set_lookahead()
 {
-    while (curridx < endidx && isspace(text[curridx]))
+    while (true)
     {
-        if (text[curridx] == '\n')
+        while (curridx < endidx && isspace(text[curridx]))
         {
-            currcol = 1;
-            currline++;
-        }
-        else
-        {
-            currcol++;
+            if (text[curridx] == '\n')
+            {
+                currcol = 1;
+                currline++;
+            }
+            else
+            {
+                currcol++;
+            }
+            curridx++;
         }
-        curridx++;
+        if (curridx < endidx || !refill())
+            break;
     }
 
     lookahead.lineno = currline;
     lookahead.colno = currcol;
+    lookahead.offset = curridx;
     if (curridx == endidx)
     {
         lookahead.type = tt_eof;
@@ -41,40 +130,23 @@ void tokenizer::set_lookahead()
 
     if (isalpha(c)) // ident
     {
-        string result;
+        int start = curridx;
         while (curridx < endidx && isalpha(text[curridx]))
         {
-            result += text[curridx];
             curridx++;
             currcol++;
         }
 
-		if (result == "repeat")
-		{
-			lookahead.type = tt_repeat;
-			return;
-		}
-		if (result == "if")
-		{
-			lookahead.type = tt_if;
-			return;
-		}
-		if (result == "def")
-		{
-			lookahead.type = tt_def;
-			return;
-		}
-        // check other keywords here
-
-		if (result == "true" || result == "false")
-		{
-			lookahead.type = tt_boolval;
-			lookahead.bool_value = result == "true";
-			return;
-		}
+        auto pkeyword = find_keyword(&text[start], curridx - start);
+        if (pkeyword)
+        {
+            lookahead.type = pkeyword->type;
+            lookahead.bool_value = pkeyword->bool_value;
+            return;
+        }
 
         lookahead.type = tt_ident;
-        lookahead.string_value = result;
+        lookahead.string_value.assign(text + start, curridx - start);
         return;
     }
 
@@ -106,3 +178,57 @@ void tokenizer::set_lookahead()
 
     lookahead.type = tt_error;
 }
+
+bool tokenizer::skip_braced_block()
+{
+    // the language has no strings or comments, so counting braces is enough
+    int depth = 1;
+    while (curridx < endidx && depth > 0)
+    {
+        char c = text[curridx];
+        if (c == '{')
+            depth++;
+        else if (c == '}')
+            depth--;
+        if (c == '\n')
+        {
+            currcol = 1;
+            currline++;
+        }
+        else
+        {
+            currcol++;
+        }
+        curridx++;
+    }
+    set_lookahead();
+    return depth == 0;
+}
+
+// streaming: the text is used up, reads the next line into the buffer. tokens don't span lines,
+// so the old contents can go
+bool tokenizer::refill()
+{
+    string line;
+    if (p_source == nullptr || !getline(*p_source, line))
+    {
+        p_source = nullptr;
+        return false;
+    }
+    p_own_text->assign(line).append(1, '\n');
+    text = p_own_text->data();
+    curridx = 0;
+    endidx = p_own_text->length();
+    return true;
+}
+
+void tokenizer::reset(const string& input)
+{
+    // the buffer is shared with the deferred def bodies of a lazy parse, if it had any
+    if (p_own_text && p_own_text.use_count() == 2)
+        p_own_text->assign(input);
+    else
+        p_own_text = make_shared<string>(input);
+    start_at(p_own_text, 0, 1, 1);
+    p_source = nullptr;
+}
@@ -2,6 +2,8 @@
 #define TOKENIZER_H
 
 #include <string>
+#include <memory>
+#include <istream>
 using namespace std; // never do this
 
 enum token_type
@@ -10,6 +12,7 @@ enum token_type
     tt_repeat,
 	tt_if,
 	tt_def,
+	tt_parallel,
 
     tt_ident,
     tt_number,
@@ -38,29 +41,82 @@ struct token
 	bool bool_value;
     int lineno;
     int colno;
+    int offset;
 };
 
 class tokenizer
 {
-    const string text;
+    // shared, so that deferred parses of function bodies can resume on the same text
+    shared_ptr<const string> p_text;
+    // the same text, if this tokenizer made it: reset reuses its buffer
+    shared_ptr<string> p_own_text;
+    const char* text;
     int curridx;
     int endidx;
     int currline, currcol;
+    // streaming: the text is read from here line by line, as the tokens are needed
+    istream* p_source = nullptr;
 
     token lookahead;
+    // the lookahead is only read when peeked at, so that a streaming parse doesn't wait for the input
+    // following a statement before handing the statement over
+    bool lookahead_stale;
 
     void set_lookahead();
+    bool refill();
 
-public:
-    tokenizer(string text) : text(text), curridx(0), endidx(text.length()), currline(1), currcol(1)
+    void start_at(shared_ptr<const string> p_new_text, int start, int line, int col)
     {
+        p_text = p_new_text;
+        text = p_text->data();
+        curridx = start;
+        endidx = p_text->length();
+        currline = line;
+        currcol = col;
         lookahead.num_value = 0;
-        lookahead.string_value = "";
-        set_lookahead();
+        lookahead.string_value.clear();
+        lookahead_stale = true;
+    }
+
+public:
+    tokenizer(string input) : p_own_text(make_shared<string>(move(input)))
+    {
+        start_at(p_own_text, 0, 1, 1);
+    }
+
+    // starts at the given position of the text, e.g. at the offset of a previously seen token
+    tokenizer(shared_ptr<const string> p_text, int start = 0, int line = 1, int col = 1)
+    {
+        start_at(p_text, start, line, col);
     }
 
-    token peek_next() { return lookahead; }
-    void move_ahead() { set_lookahead(); }
+    // streaming: reads the text from source as it goes. token offsets are not kept valid, since the text
+    // already tokenized is dropped
+    explicit tokenizer(istream& source) : p_own_text(make_shared<string>())
+    {
+        start_at(p_own_text, 0, 1, 1);
+        p_source = &source;
+    }
+
+    // starts over on a new text, in the buffer of the previous one unless a deferred parse still needs it
+    void reset(const string& input);
+
+    token peek_next()
+    {
+        if (lookahead_stale)
+        {
+            set_lookahead();
+            lookahead_stale = false;
+        }
+        return lookahead;
+    }
+    void move_ahead() { lookahead_stale = true; }
+
+    // the lookahead must be '{': skips to the token after the matching '}' by brace counting only.
+    // returns false if the text ends before the block is closed
+    bool skip_braced_block();
+
+    shared_ptr<const string> get_text() const { return p_text; }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,188 @@
+#include "stdafx.h"
+#include "trace.h"
+
+#include <string>
+#include <unordered_map>
+
+namespace
+{
+    // thrown by the recorders to stop a recording that cannot produce a replayable trace
+    struct not_replayable { };
+
+    const size_t max_loop_period = 256;
+
+    class recorder
+    {
+        // the calls are interned by native and argument identity: constants evaluate to
+        // the same value object every time, and so do variables bound to them
+        unordered_map<string, int> call_index;
+
+    public:
+        vector<trace_call> calls;
+        vector<int> sequence;
+
+        void record(int native_id, const vector<shared_ptr<value>>& args)
+        {
+            string key(reinterpret_cast<const char*>(&native_id), sizeof(native_id));
+            for (auto& arg : args)
+            {
+                auto parg = arg.get();
+                key.append(reinterpret_cast<const char*>(&parg), sizeof(parg));
+            }
+            auto inserted = call_index.insert(make_pair(key, (int)calls.size()));
+            if (inserted.second)
+                calls.push_back(trace_call { native_id, args });
+            sequence.push_back(inserted.first->second);
+        }
+    };
+
+    // compresses sequence[begin, end) greedily: at every position the period whose repetitions
+    // cover the longest stretch wins, and the loop body is compressed recursively.
+    // next[i] is the next position with the same call as position i (or sequence.size())
+    void compress(const vector<int>& sequence, const vector<size_t>& next, size_t begin, size_t end,
+                  vector<trace_op>& ops)
+    {
+        size_t i = begin;
+        while (i < end)
+        {
+            size_t best_period = 1, best_count = 1;
+            // a period can only start over at a position with the same call
+            for (size_t j = next[i]; j < end && j - i <= max_loop_period; j = next[j])
+            {
+                size_t period = j - i;
+                size_t count = 1;
+                while (i + (count + 1) * period <= end &&
+                       equal(sequence.begin() + i, sequence.begin() + i + period, sequence.begin() + i + count * period))
+                    count++;
+                if (count >= 2 && period * count > best_period * best_count)
+                {
+                    best_period = period;
+                    best_count = count;
+                }
+            }
+
+            if (best_period == 1)
+            {
+                // runs of the same call are counted on the spot
+                size_t count = 1;
+                while (i + count < end && sequence[i + count] == sequence[i])
+                    count++;
+                ops.push_back(trace_op { sequence[i], 0, (long)count });
+                i += count;
+            }
+            else
+            {
+                size_t loop = ops.size();
+                ops.push_back(trace_op { -1, 0, (long)best_count });
+                compress(sequence, next, i, i + best_period, ops);
+                ops[loop].length = ops.size() - loop - 1;
+                i += best_period * best_count;
+            }
+        }
+    }
+}
+
+trace* record_trace(program& p, const activation_record& host)
+{
+    recorder rec;
+    auto& natives = host.get_natives();
+    vector<installed_function> recorders(natives.size());
+    vector<const installed_function*> recording_natives(natives.size());
+    for (size_t id = 0; id < natives.size(); id++)
+    {
+        int native_id = id;
+        bool impure = (natives[id]->attributes & na_impure) != 0;
+        recorders[id].argnum = natives[id]->argnum;
+        // the recorder appends to one sequence, so it is not safe to call from several threads
+        recorders[id].attributes = natives[id]->attributes & ~na_thread_safe;
+        recorders[id].function = [&rec, native_id, impure](const activation_record&, const vector<shared_ptr<value>>& args)
+        {
+            if (impure)
+                throw not_replayable();
+            rec.record(native_id, args);
+        };
+        recording_natives[id] = &recorders[id];
+    }
+
+    // host functions of inner records have no native id to record them by
+    host_function_redirect reject_host_functions = [](const installed_function*) -> const installed_function*
+    {
+        throw not_replayable();
+    };
+
+    try
+    {
+        // stands for the program's own record, so that the calls find their functions as in p.execute(host)
+        activation_record recording(&host, &recording_natives);
+        recording.redirect_host_functions(&reject_host_functions);
+        p.execute_in(recording);
+    }
+    catch (const not_replayable&)
+    {
+        return nullptr;
+    }
+    catch (const runtime_exception&)
+    {
+        // interpreting reproduces the failure together with the calls preceding it
+        return nullptr;
+    }
+    catch (const parse_exception&)
+    {
+        return nullptr;
+    }
+
+    auto& sequence = rec.sequence;
+    vector<size_t> next(sequence.size());
+    vector<size_t> last_seen(rec.calls.size(), sequence.size());
+    for (size_t i = sequence.size(); i-- > 0; )
+    {
+        next[i] = last_seen[sequence[i]];
+        last_seen[sequence[i]] = i;
+    }
+
+    unique_ptr<trace> t(new trace());
+    compress(sequence, next, 0, sequence.size(), t->ops);
+    t->calls = move(rec.calls);
+    return t.release();
+}
+
+void trace::replay(const activation_record& r) const
+{
+    vector<const installed_function*> functions;
+    functions.reserve(calls.size());
+    for (auto& call : calls)
+        functions.push_back(r.get_native(call.native_id));
+    replay(r, functions, 0, ops.size());
+}
+
+void trace::replay(const activation_record& r, const vector<const installed_function*>& functions,
+                   size_t begin, size_t end) const
+{
+    size_t i = begin;
+    while (i < end)
+    {
+        auto& op = ops[i];
+        if (op.length == 0)
+        {
+            auto& call = calls[op.call];
+            auto pf = functions[op.call];
+            for (long k = 0; k < op.count; k++)
+            {
+                pf->function(r, call.args);
+                if (r.failed())
+                    return;
+            }
+            i++;
+        }
+        else
+        {
+            for (long k = 0; k < op.count; k++)
+            {
+                replay(r, functions, i + 1, i + 1 + op.length);
+                if (r.failed())
+                    return;
+            }
+            i += 1 + op.length;
+        }
+    }
+}
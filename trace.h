@@ -0,0 +1,54 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <vector>
+#include <memory>
+
+#include "value.h"
+#include "nodes.h"
+
+using namespace std;
+
+/*
+A program has no inputs besides its constants, and natives return nothing, so the sequence of
+native calls it makes is known before it runs. record_trace runs a program against recording
+natives and stores this sequence; replaying the trace calls the real natives without interpreting
+the program again.
+*/
+
+struct trace_call
+{
+    int native_id;
+    vector<shared_ptr<value>> args;
+};
+
+struct trace_op
+{
+    // length == 0: makes the call with index `call` `count` times in a row
+    // length > 0: runs the following `length` ops `count` times
+    int call;
+    int length;
+    long count;
+};
+
+class trace
+{
+    void replay(const activation_record& r, const vector<const installed_function*>& functions,
+                size_t begin, size_t end) const;
+
+public:
+    // distinct calls; the same call made twice (same native, same argument values) is stored once
+    vector<trace_call> calls;
+    vector<trace_op> ops;
+
+    // r must be (a descendant of) the record the program was recorded against. stops at the first call
+    // that fails, when r reports errors without exceptions
+    void replay(const activation_record& r) const;
+};
+
+// runs the program against recording natives. returns nullptr if the program cannot be replayed,
+// i.e. it calls an impure native or a host function of an inner record, or fails; such programs have
+// to be interpreted. none of the host's functions is called while recording
+trace* record_trace(program& p, const activation_record& host);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,299 @@
+#include "stdafx.h"
+#include "transpiler.h"
+
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+
+namespace
+{
+    const char* generated_prelude = R"%(
+using namespace std;
+
+#ifdef _WIN32
+#define SCRIPT_EXPORT extern "C" __declspec(dllexport)
+#else
+#define SCRIPT_EXPORT extern "C" __attribute__((visibility("default")))
+#endif
+
+namespace
+{
+    typedef shared_ptr<value> val;
+
+    inline bool is_bool(const val& v)
+    {
+        return dynamic_cast<typed_value<bool>*>(v.get()) != nullptr;
+    }
+
+    inline bool bool_of(const val& v)
+    {
+        return static_cast<typed_value<bool>*>(v.get())->value;
+    }
+
+    inline val host_var(const activation_record& r, const char* name)
+    {
+        auto pvar = r.get_var(name);
+        if (pvar == nullptr)
+            r.fail("impossible: cannot find variable in name scope");
+        return pvar;
+    }
+)%";
+
+    class emitter
+    {
+        // mirrors an activation record
+        struct level
+        {
+            // name -> C++ variable and number of parameters; the first def of a name wins, as in the records
+            unordered_map<string, pair<string, int>> functions;
+            // the defs installing them
+            unordered_set<const def_statement*> installing;
+            unordered_set<string> vars;
+        };
+
+        const transpile_target& target;
+        // for the bodies of lazy defs, which report parse errors through a record
+        activation_record parse_record;
+        vector<level> levels;
+        unordered_map<string, string> constants;
+        ostringstream constant_defs;
+        ostringstream code;
+        int indent = 1;
+        int next_id = 0;
+
+        ostream& line()
+        {
+            return code << string(indent * 4, ' ');
+        }
+
+        void open()
+        {
+            line() << "{" << endl;
+            indent++;
+        }
+
+        void close()
+        {
+            indent--;
+            line() << "}" << endl;
+        }
+
+        static string quoted(const string& s)
+        {
+            return "\"" + s + "\"";
+        }
+
+        // one per distinct value
+        string constant(const char* type, const string& init)
+        {
+            auto definition = string("make_shared<typed_value<") + type + ">>(" + init + ")";
+            auto found = constants.find(definition);
+            if (found != constants.end())
+                return found->second;
+            auto name = "k" + to_string(constants.size());
+            constant_defs << "    const val " << name << " = " << definition << ";" << endl;
+            constants.insert(make_pair(definition, name));
+            return name;
+        }
+
+        // a variable the records would find in the host's rather than in a def's parameters
+        bool is_host_var(const expr* e) const
+        {
+            auto pvar = dynamic_cast<const var*>(e);
+            if (!pvar)
+                return false;
+            for (auto it = levels.rbegin(); it != levels.rend(); ++it)
+                if (it->vars.count(pvar->name))
+                    return false;
+            return true;
+        }
+
+        // a C++ expression for the value. host variables are fetched into a temporary first,
+        // in a block the caller opened
+        string expression(const expr* e)
+        {
+            if (auto pint = dynamic_cast<const const_expr<int>*>(e))
+                return constant("int", to_string(pint->pv->value));
+            if (auto ptime = dynamic_cast<const const_expr<chrono::seconds>*>(e))
+                return constant("chrono::seconds", "chrono::seconds(" + to_string(ptime->pv->value.count()) + ")");
+            if (auto pbool = dynamic_cast<const const_expr<bool>*>(e))
+                return constant("bool", pbool->pv->value ? "true" : "false");
+            auto pvar = dynamic_cast<const var*>(e);
+            if (!pvar)
+                throw runtime_exception("cannot transpile expression");
+            if (!is_host_var(e))
+                return "a_" + pvar->name;
+            auto name = "h" + to_string(next_id++);
+            line() << "val " << name << " = host_var(r, " << quoted(pvar->name) << ");" << endl;
+            line() << "if (r.failed()) return;" << endl;
+            return name;
+        }
+
+        void statement_code(statement* s)
+        {
+            if (auto pcall = dynamic_cast<function_call*>(s))
+                return call(pcall);
+
+            if (auto pcompound = dynamic_cast<compound_statement*>(s))
+            {
+                open();
+                block(pcompound);
+                return close();
+            }
+
+            // a parallel repeat too: its output comes out as from a plain repeat anyway
+            if (auto prepeat = dynamic_cast<repeat_statement*>(s))
+            {
+                auto i = "i" + to_string(next_id++);
+                line() << "for (long " << i << " = 0; " << i << " < " << prepeat->num_repeat << "; " << i << "++)" << endl;
+                return statement_code(prepeat->p_statement.get());
+            }
+
+            if (auto pif = dynamic_cast<if_statement*>(s))
+            {
+                bool hoisting = is_host_var(pif->p_expression.get());
+                if (hoisting)
+                    open();
+                auto condition = expression(pif->p_expression.get());
+                line() << "if (!is_bool(" << condition << "))" << endl;
+                line() << "    return r.fail(\"type mismatch for if condition, must be bool\");" << endl;
+                line() << "if (bool_of(" << condition << "))" << endl;
+                statement_code(pif->p_statement.get());
+                if (hoisting)
+                    close();
+                return;
+            }
+
+            if (auto pdef = dynamic_cast<def_statement*>(s))
+                return def(pdef);
+
+            throw runtime_exception("cannot transpile statement");
+        }
+
+        // the statements of a compound, in the block already opened for it
+        void block(compound_statement* pcompound)
+        {
+            levels.emplace_back();
+            // the defs are declared up front, so that the defs of the block can call each other
+            for (auto& p_statement : pcompound->statements)
+            {
+                auto pdef = dynamic_cast<def_statement*>(p_statement.get());
+                if (!pdef || levels.back().functions.count(pdef->name))
+                    continue;
+                auto name = "d" + to_string(next_id++) + "_" + pdef->name;
+                levels.back().functions.insert(make_pair(pdef->name, make_pair(name, (int)pdef->argnames.size())));
+                levels.back().installing.insert(pdef);
+                line() << "function<void(" << parameter_types(pdef->argnames.size()) << ")> " << name << ";" << endl;
+            }
+            for (auto& p_statement : pcompound->statements)
+                statement_code(p_statement.get());
+            levels.pop_back();
+        }
+
+        static string parameter_types(size_t argnum)
+        {
+            string types;
+            for (size_t i = 0; i < argnum; i++)
+                types += i == 0 ? "val" : ", val";
+            return types;
+        }
+
+        void def(def_statement* pdef)
+        {
+            // a later def of the same name is not installed
+            if (!levels.back().installing.count(pdef))
+                return;
+            auto body = pdef->body(parse_record);
+            string params;
+            for (auto& argname : pdef->argnames)
+                params += (params.empty() ? "val a_" : ", val a_") + argname;
+            line() << levels.back().functions[pdef->name].first << " = [&](" << params << ")" << endl;
+            levels.emplace_back();
+            for (auto& argname : pdef->argnames)
+                levels.back().vars.insert(argname);
+            // the lambda's braces are those of the body
+            open();
+            if (auto pcompound = dynamic_cast<compound_statement*>(body))
+                block(pcompound);
+            else
+                statement_code(body);
+            indent--;
+            line() << "};" << endl;
+            levels.pop_back();
+        }
+
+        void call(function_call* pcall)
+        {
+            auto& params = pcall->p_params->params;
+            bool hoisting = any_of(params.begin(), params.end(), [this](const shared_ptr<expr>& e) { return is_host_var(e.get()); });
+            if (hoisting)
+                open();
+            string args;
+            for (auto& param : params)
+                args += (args.empty() ? "" : ", ") + expression(param.get());
+
+            if (pcall->binding.native_id >= 0)
+                line() << native_function(pcall) << "(r, { " << args << " });" << endl;
+            else
+            {
+                int hops = pcall->binding.scope_hops;
+                if (hops >= (int)levels.size())
+                    throw runtime_exception("cannot transpile a call of " + pcall->function_name + ", a function of the host");
+                auto& functions = levels[levels.size() - 1 - hops].functions;
+                auto pfunction = functions.find(pcall->function_name);
+                if (pfunction == functions.end())
+                    line() << "return r.fail(\"impossible: cannot find function in name scope\");" << endl;
+                else if (pfunction->second.second != (int)pcall->p_params->params.size())
+                    line() << "return r.fail(\"impossible: number of arguments mismatch for function call\");" << endl;
+                else
+                {
+                    auto& name = pfunction->second.first;
+                    line() << "if (!" << name << ")" << endl;
+                    line() << "    return r.fail(\"impossible: cannot find function in name scope\");" << endl;
+                    line() << name << "(" << args << ");" << endl;
+                }
+            }
+            line() << "if (r.failed()) return;" << endl;
+            if (hoisting)
+                close();
+        }
+
+        string native_function(const function_call* pcall)
+        {
+            int argnum = pcall->p_params->params.size();
+            for (auto& native : target.natives)
+                if (native.name == pcall->function_name && native.argnum == argnum)
+                    return native.cpp_function;
+            throw runtime_exception("no signature for native " + pcall->function_name + " with " +
+                                    to_string(argnum) + " arguments");
+        }
+
+    public:
+        emitter(const transpile_target& target) : target(target) { }
+
+        string emit(program& p)
+        {
+            // the record program::execute creates
+            block(&p);
+
+            ostringstream out;
+            out << "// generated by transpile() from a parsed script" << endl;
+            out << "#include <memory>" << endl << "#include <vector>" << endl << "#include <functional>" << endl
+                << "#include <chrono>" << endl << endl;
+            out << "#include \"value.h\"" << endl << "#include \"namescope.h\"" << endl;
+            for (auto& include : target.includes)
+                out << "#include " << include << endl;
+            out << generated_prelude << endl;
+            out << constant_defs.str() << "}" << endl << endl;
+            out << "SCRIPT_EXPORT void " << target.entry << "(activation_record& r)" << endl;
+            out << "{" << endl << code.str() << "}" << endl;
+            return out.str();
+        }
+    };
+}
+
+string transpile(program& p, const transpile_target& target)
+{
+    return emitter(target).emit(p);
+}
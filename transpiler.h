@@ -0,0 +1,47 @@
+#ifndef TRANSPILER_H
+#define TRANSPILER_H
+
+#include <string>
+#include <vector>
+
+#include "nodes.h"
+
+using namespace std;
+
+// a native as the generated code calls it: directly, through the C++ function implementing it
+struct native_signature
+{
+    string name;
+    int argnum;
+    string cpp_function;
+};
+
+// what the generated source is compiled against
+struct transpile_target
+{
+    // headers declaring the natives' C++ functions, as #include arguments, e.g. "\"installed_functions.h\""
+    vector<string> includes;
+    vector<native_signature> natives;
+    // the name of the exported entry point, see compiled_script.h
+    string entry = "run_script";
+};
+
+/*
+ahead-of-time translation of a parsed program into C++ source, to be compiled into a shared library
+with the host's headers and compiler, and loaded with compiled_script. the entry point is
+    extern "C" void <entry>(activation_record& r)
+where r stands for the program's own record, as given to compound_statement::execute_in; it does what
+program::execute does:
+  - repeat becomes a for loop; a parallel repeat too, which comes out the same as a plain one
+  - a def becomes a std::function local to the block of its compound statement, assigned a lambda
+    capturing by reference, so it sees the parameters of the enclosing defs as the lexical records would.
+    calls are resolved at translation time, mirroring scope_hops
+  - natives are called directly, with the same arguments as the interpreter passes
+the values are those of the interpreter, so the natives behave the same. the difference: the natives get
+the program's record rather than that of their compound, and errors carry no fault node.
+throws runtime_exception if the program calls a native the target doesn't describe, or a script function
+of the host's records, and parse_exception if a lazily parsed def body fails to parse
+*/
+string transpile(program& p, const transpile_target& target);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,148 @@
+#include "stdafx.h"
+#include "work_pool.h"
+
+#include <algorithm>
+
+namespace
+{
+    // set while the thread runs loop iterations, so that nested loops don't wait for the pool they occupy
+    thread_local bool in_loop = false;
+}
+
+work_pool::work_pool(int nthreads)
+{
+    for (int i = 0; i <= nthreads; i++)
+        slots.emplace_back(new slot());
+    for (int i = 1; i <= nthreads; i++)
+        threads.emplace_back([this, i] { worker_loop(i); });
+}
+
+work_pool::~work_pool()
+{
+    {
+        lock_guard<mutex> lock(state_mutex);
+        closing = true;
+    }
+    wake_cv.notify_all();
+    for (auto& t : threads)
+        t.join();
+}
+
+work_pool& work_pool::shared()
+{
+    static work_pool pool(max(1u, thread::hardware_concurrency()) - 1);
+    return pool;
+}
+
+void work_pool::parallel_for(long n, const function<void(int, long)>& body)
+{
+    unique_lock<mutex> loop_lock(loop_mutex, defer_lock);
+    if (in_loop || threads.empty() || n < 2 || !loop_lock.try_lock())
+    {
+        for (long i = 0; i < n; i++)
+            body(0, i);
+        return;
+    }
+
+    long nslots = slots.size();
+    for (long k = 0; k < nslots; k++)
+    {
+        lock_guard<mutex> lock(slots[k]->m);
+        slots[k]->begin = n * k / nslots;
+        slots[k]->end = n * (k + 1) / nslots;
+    }
+    {
+        lock_guard<mutex> lock(state_mutex);
+        p_body = &body;
+        busy_threads = threads.size();
+        generation++;
+    }
+    wake_cv.notify_all();
+
+    in_loop = true;
+    run_slot(0);
+    in_loop = false;
+
+    unique_lock<mutex> lock(state_mutex);
+    done_cv.wait(lock, [this] { return busy_threads == 0; });
+    p_body = nullptr;
+}
+
+void work_pool::worker_loop(int worker)
+{
+    in_loop = true;
+    unsigned seen = 0;
+    while (true)
+    {
+        {
+            unique_lock<mutex> lock(state_mutex);
+            wake_cv.wait(lock, [&] { return closing || generation != seen; });
+            if (closing)
+                return;
+            seen = generation;
+        }
+        run_slot(worker);
+        {
+            lock_guard<mutex> lock(state_mutex);
+            if (--busy_threads == 0)
+                done_cv.notify_one();
+        }
+    }
+}
+
+void work_pool::run_slot(int worker)
+{
+    long i;
+    while (take(worker, i) || steal(worker, i))
+        (*p_body)(worker, i);
+}
+
+bool work_pool::take(int worker, long& i)
+{
+    auto& own = *slots[worker];
+    lock_guard<mutex> lock(own.m);
+    if (own.begin == own.end)
+        return false;
+    i = own.begin++;
+    return true;
+}
+
+bool work_pool::steal(int worker, long& i)
+{
+    while (true)
+    {
+        // the sizes are only a hint; the victim's range is checked again under its lock
+        int victim = -1;
+        long largest = 0;
+        for (int k = 0; k < (int)slots.size(); k++)
+        {
+            lock_guard<mutex> lock(slots[k]->m);
+            if (slots[k]->end - slots[k]->begin > largest)
+            {
+                largest = slots[k]->end - slots[k]->begin;
+                victim = k;
+            }
+        }
+        if (victim < 0)
+            return false;
+
+        long begin, end;
+        {
+            lock_guard<mutex> lock(slots[victim]->m);
+            auto& v = *slots[victim];
+            if (v.begin == v.end)
+                continue;
+            begin = v.begin + (v.end - v.begin) / 2;
+            end = v.end;
+            v.end = begin;
+        }
+        // the victim's lock is released first: holding two slot locks at once could deadlock two thieves.
+        // meanwhile the stolen iterations are in no slot, but this worker runs them all the same
+        auto& own = *slots[worker];
+        lock_guard<mutex> lock(own.m);
+        i = begin;
+        own.begin = begin + 1;
+        own.end = end;
+        return true;
+    }
+}
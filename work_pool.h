@@ -0,0 +1,68 @@
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <vector>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+/*
+threads running the iterations of a loop. the iterations are split into one range per worker;
+a worker takes iterations from the front of its own range, and when it runs out, it steals the
+upper half of the largest range left. the thread starting the loop works on it as worker 0.
+one loop runs at a time: a loop started while another one runs, or from inside a loop body,
+runs on the calling thread alone
+*/
+
+class work_pool
+{
+    struct slot
+    {
+        mutex m;
+        long begin = 0;
+        long end = 0;
+    };
+
+    vector<thread> threads;
+    // one per worker, the calling thread's first
+    vector<unique_ptr<slot>> slots;
+
+    mutex loop_mutex;
+    mutex state_mutex;
+    condition_variable wake_cv;
+    condition_variable done_cv;
+    const function<void(int, long)>* p_body = nullptr;
+    unsigned generation = 0;
+    int busy_threads = 0;
+    bool closing = false;
+
+    void worker_loop(int worker);
+    void run_slot(int worker);
+    bool take(int worker, long& i);
+    bool steal(int worker, long& i);
+
+public:
+    explicit work_pool(int nthreads);
+    work_pool(const work_pool&) = delete;
+    ~work_pool();
+
+    // the number of workers, including the calling thread
+    int concurrency() const
+    {
+        return slots.size();
+    }
+
+    // calls body(worker, i) for every i in [0, n), and returns when all calls are done.
+    // worker is in [0, concurrency()); the calls with the same worker are made one at a time.
+    // body must not throw
+    void parallel_for(long n, const function<void(int, long)>& body);
+
+    // a pool with a thread per core, started on first use
+    static work_pool& shared();
+};
+
+#endif
\ No newline at end of file